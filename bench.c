@@ -0,0 +1,543 @@
+/*
+ * sqler - a JavaScript-MySQL bridge in C
+ *
+ * Copyright (C) 2010 Pawel Foremski <pawel@foremski.pl>
+ * Licensed under GPLv3
+ */
+
+/*
+ * Load generator: loads the modules like rpcd does, seeds a database with
+ * fixture data and calls handle() with synthetic requests from many threads.
+ * Requests run as a role with a query whitelist scanned from a fixture source,
+ * so they take the prepared statement, result cache and coalescing paths.
+ *
+ * The modules are bound lazily, rpcd's error reply helper is replaced by a
+ * stub below so that failed requests only show up in the counters.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <rpcd/rpcd_module.h>
+#include "common.h"
+
+enum op { OP_LOGIN, OP_SMALL, OP_LARGE, OP_INSERT, OP_MAX };
+
+static const char *opnames[OP_MAX] = { "login", "small", "large", "insert" };
+
+/** Queries of requests, also written to the scanned fixture source */
+static const char *opqueries[OP_MAX] = {
+	NULL,
+	SQLER_TAG " SELECT id, name, value FROM bench_items WHERE id = ?int?",
+	SQLER_TAG " SELECT id, name, value FROM bench_items LIMIT 1000",
+	SQLER_TAG " INSERT INTO bench_log (item, value) VALUES (?int?, ?dbl?)",
+};
+
+/** Benchmark options */
+static struct {
+	const char *host, *db, *user, *pass;
+	int threads;                 /** number of client threads */
+	int ops;                     /** requests per thread */
+	int rows;                    /** fixture rows */
+	int weights[OP_MAX];         /** request mix */
+	int total;                   /** sum of weights */
+	int ttl;                     /** result cache TTL [s] */
+	bool admin;                  /** log in as admin, no whitelist */
+	const char *scan;            /** fixture source scanned for queries */
+} opt = {
+	.host = "localhost", .db = "sqler_bench", .user = "root", .pass = "root",
+	.threads = 8, .ops = 10000, .rows = 10000, .ttl = 1,
+	.weights = { 5, 70, 5, 20 },
+};
+
+/** Loaded module */
+struct bmod {
+	struct mod mod;
+	struct api *api;
+};
+
+static struct dir dir;
+static struct bmod common_mod, query_mod, login_mod;
+
+/** Latencies measured by one thread */
+struct sample {
+	double *lat[OP_MAX];         /** request latencies [ms] */
+	int num[OP_MAX];             /** number of requests */
+	int errors[OP_MAX];          /** number of failed requests */
+};
+
+/*****************************************/
+
+static void usage(void)
+{
+	printf("Usage: sqler-bench [OPTIONS]\n");
+	printf("\n");
+	printf("  -H <host>      MySQL host [%s]\n", opt.host);
+	printf("  -D <db>        database for fixtures, will be overwritten [%s]\n", opt.db);
+	printf("  -u <user>      MySQL user [%s]\n", opt.user);
+	printf("  -p <pass>      MySQL password\n");
+	printf("  -t <num>       client threads [%d]\n", opt.threads);
+	printf("  -n <num>       requests per thread [%d]\n", opt.ops);
+	printf("  -r <num>       fixture rows [%d]\n", opt.rows);
+	printf("  -m <mix>       request mix [login=%d,small=%d,large=%d,insert=%d]\n",
+		opt.weights[OP_LOGIN], opt.weights[OP_SMALL], opt.weights[OP_LARGE], opt.weights[OP_INSERT]);
+	printf("  -T <sec>       result cache TTL, 0 to disable [%d]\n", opt.ttl);
+	printf("  -a             log in as admin: no whitelist, prepared statements and cache\n");
+}
+
+static bool parse_mix(char *mix)
+{
+	char *tok, *save, *eq;
+	int i;
+
+	memset(opt.weights, 0, sizeof opt.weights);
+
+	for (tok = strtok_r(mix, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		eq = strchr(tok, '=');
+		if (!eq)
+			return false;
+		*eq = '\0';
+
+		for (i = 0; i < OP_MAX; i++) {
+			if (streq(tok, opnames[i]))
+				break;
+		}
+		if (i == OP_MAX)
+			return false;
+
+		opt.weights[i] = atoi(eq + 1);
+	}
+
+	return true;
+}
+
+static bool parse_argv(int argc, char *argv[])
+{
+	int i, c;
+
+	while ((c = getopt(argc, argv, "H:D:u:p:t:n:r:m:T:ah")) != -1) {
+		switch (c) {
+			case 'H': opt.host = optarg; break;
+			case 'D': opt.db = optarg; break;
+			case 'u': opt.user = optarg; break;
+			case 'p': opt.pass = optarg; break;
+			case 't': opt.threads = atoi(optarg); break;
+			case 'n': opt.ops = atoi(optarg); break;
+			case 'r': opt.rows = atoi(optarg); break;
+			case 'T': opt.ttl = atoi(optarg); break;
+			case 'a': opt.admin = true; break;
+			case 'm':
+				if (!parse_mix(optarg)) {
+					fprintf(stderr, "invalid mix: %s\n", optarg);
+					return false;
+				}
+				break;
+			default:
+				usage();
+				return false;
+		}
+	}
+
+	for (i = 0, opt.total = 0; i < OP_MAX; i++)
+		opt.total += opt.weights[i];
+
+	if (opt.threads < 1 || opt.ops < 1 || opt.rows < 1 || opt.total < 1) {
+		usage();
+		return false;
+	}
+
+	return true;
+}
+
+/*****************************************/
+
+/** Run fixture query, the modules are not loaded yet */
+static void run(MYSQL *conn, const char *sql)
+{
+	if (mysql_query(conn, sql) != 0)
+		die("query '%s' failed: %s", sql, mysql_error(conn));
+
+	mysql_free_result(mysql_use_result(conn));
+}
+
+/** Create fixture database */
+static bool seed(void)
+{
+	MYSQL *conn;
+	xstr *sql = NULL;
+	FILE *fp;
+	char *tmp;
+	int i;
+	void *mm = mmatic_create();
+
+	conn = mysql_init(NULL);
+	if (!mysql_real_connect(conn, opt.host, opt.user, opt.pass, NULL, 0, NULL, 0)) {
+		fprintf(stderr, "connecting to MySQL failed: %s\n", mysql_error(conn));
+		return false;
+	}
+
+	run(conn, mmatic_printf(mm, "DROP DATABASE IF EXISTS %s", opt.db));
+	run(conn, mmatic_printf(mm, "CREATE DATABASE %s", opt.db));
+	run(conn, mmatic_printf(mm, "USE %s", opt.db));
+
+	run(conn, SQLER_USERS_TABLE);
+	run(conn, mmatic_printf(mm, "INSERT INTO users SET login='bench', password='bench', role='%s'",
+		opt.admin ? "admin" : "bench"));
+
+	run(conn,
+		"CREATE TABLE bench_items ("
+		"  id    int unsigned NOT NULL,"
+		"  name  varchar(64),"
+		"  value double,"
+		"  PRIMARY KEY (id))");
+
+	run(conn,
+		"CREATE TABLE bench_log ("
+		"  id    int unsigned NOT NULL AUTO_INCREMENT,"
+		"  item  int unsigned,"
+		"  value double,"
+		"  PRIMARY KEY (id))");
+
+	/* insert in chunks of 1000 rows */
+	for (i = 0; i < opt.rows; i++) {
+		if (i % 1000 == 0)
+			sql = xstr_create("INSERT INTO bench_items VALUES ", mm);
+		else
+			xstr_append_char(sql, ',');
+
+		xstr_append(sql, mmatic_printf(mm, "(%d, 'item %d', %d.5)", i + 1, i + 1, i));
+
+		if (i % 1000 == 999 || i == opt.rows - 1)
+			run(conn, xstr_string(sql));
+	}
+
+	mysql_close(conn);
+
+	/* source with whitelisted queries of the "bench" role */
+	tmp = mmatic_strdup("/tmp/sqler-bench-XXXXXX", mm);
+	if (!mkdtemp(tmp)) {
+		fprintf(stderr, "creating fixture directory failed: %s\n", strerror(errno));
+		return false;
+	}
+
+	opt.scan = strdup(mmatic_printf(mm, "%s/bench.js", tmp));
+	fp = fopen(opt.scan, "w");
+	if (!fp) {
+		fprintf(stderr, "writing %s failed: %s\n", opt.scan, strerror(errno));
+		return false;
+	}
+
+	for (i = 0; i < OP_MAX; i++) {
+		if (opqueries[i])
+			fprintf(fp, "var %s = \"%s\";\n", opnames[i], opqueries[i]);
+	}
+	fclose(fp);
+
+	mmatic_free(mm);
+	return true;
+}
+
+/*****************************************/
+
+static bool load(struct bmod *m, const char *name, ut *cfg)
+{
+	void *so;
+	char *path;
+
+	path = mmatic_printf(cfg, "./%s.so", name);
+
+	/* common.so provides functions used by other modules */
+	so = dlopen(path, RTLD_LAZY | RTLD_GLOBAL);
+	if (!so) {
+		fprintf(stderr, "loading %s failed: %s\n", path, dlerror());
+		return false;
+	}
+
+	m->api = dlsym(so, mmatic_printf(cfg, "%s_api", name));
+	if (!m->api) {
+		fprintf(stderr, "%s: no %s_api\n", path, name);
+		return false;
+	}
+
+	m->mod.dir = &dir;
+	m->mod.cfg = cfg;
+
+	if (m->api->init && !m->api->init(&m->mod)) {
+		fprintf(stderr, "%s: init() failed\n", path);
+		return false;
+	}
+
+	return true;
+}
+
+static bool load_all(void)
+{
+	mmatic *mm = mmatic_create();
+	ut *cfg, *admin, *role;
+
+	dir.prv = ut_new_thash(thash_create_strkey(NULL, mm), mm);
+
+	/* common */
+	cfg = ut_new_thash(thash_create_strkey(NULL, mm), mm);
+	uth_set_char(cfg, "dbhost", opt.host);
+	uth_set_char(cfg, "dbname", opt.db);
+	uth_set_int(cfg, "pool-min", opt.threads);
+	uth_set_int(cfg, "pool-max", opt.threads * 2);
+
+	admin = uth_path_create(cfg, "roles", "admin");
+	uth_set_char(admin, "user", opt.user);
+	uth_set_char(admin, "pass", opt.pass);
+
+	role = uth_path_create(cfg, "roles", "bench");
+	uth_set_char(role, "user", opt.user);
+	uth_set_char(role, "pass", opt.pass);
+
+	if (!load(&common_mod, "common", cfg))
+		return false;
+
+	/* query - whitelist of "bench" role from fixture source */
+	cfg = ut_new_thash(thash_create_strkey(NULL, mm), mm);
+	uth_set_bool(cfg, "reload", false);
+	uth_set_int(cfg, "cache-ttl", opt.ttl);
+	uth_set_bool(cfg, "coalesce", true);
+	utl_add_char(uth_set_tlist(uth_path_create(cfg, "scan"), "bench", NULL), opt.scan);
+
+	if (!load(&query_mod, "query", cfg))
+		return false;
+
+	/* login */
+	cfg = ut_new_thash(thash_create_strkey(NULL, mm), mm);
+
+	if (!load(&login_mod, "login", cfg))
+		return false;
+
+	return true;
+}
+
+/*****************************************/
+
+/** Stand-in for rpcd's error reply helper, called by the modules on failure */
+bool _err(int code, const char *msg, const char *data, struct req *req, const char *filename, unsigned int linenum)
+{
+	dbg(5, "%s:%u: error %d: %s (%s)\n", filename, linenum, code, msg, data ? data : "");
+	uth_set_int(req->reply, "error", code);
+	return false;
+}
+
+/** Make request to given module, preceded by common module like in rpcd */
+static bool call(struct bmod *m, const char *method, ut *params, ut **reply)
+{
+	struct req *req;
+	bool ret;
+
+	req = mmatic_zalloc(sizeof *req, params);
+	req->method = method;
+	req->params = params;
+	req->reply = ut_new_thash(thash_create_strkey(NULL, params), params);
+	req->prv = ut_new_thash(thash_create_strkey(NULL, params), params);
+
+	req->mod = &common_mod.mod;
+	ret = common_mod.api->handle(req);
+
+	if (ret) {
+		req->mod = &m->mod;
+		ret = m->api->handle(req);
+	}
+
+	if (reply)
+		*reply = req->reply;
+
+	return ret && ut_ok(req->reply);
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/** Log in as fixture user
+ * @retval NULL       login failed */
+static const char *do_login(void *mm)
+{
+	ut *params, *reply;
+
+	params = ut_new_thash(thash_create_strkey(NULL, mm), mm);
+	uth_set_char(params, "login", "bench");
+	uth_set_char(params, "password", "bench");
+
+	if (!call(&login_mod, "login", params, &reply))
+		return NULL;
+
+	return uth_char(reply, "session");
+}
+
+static bool do_query(void *mm, const char *session, enum op op, unsigned int *seed)
+{
+	ut *params, *data;
+
+	params = ut_new_thash(thash_create_strkey(NULL, mm), mm);
+	uth_set_char(params, "session", session);
+
+	uth_set_char(params, "query", opqueries[op]);
+
+	switch (op) {
+		case OP_SMALL:
+			data = uth_set_tlist(params, "data", NULL);
+			utl_add_int(data, rand_r(seed) % opt.rows + 1);
+			break;
+		case OP_LARGE:
+			break;
+		default:
+			data = uth_set_tlist(params, "data", NULL);
+			utl_add_int(data, rand_r(seed) % opt.rows + 1);
+			utl_add_double(data, rand_r(seed) / 1000.0);
+			break;
+	}
+
+	return call(&query_mod, "query", params, NULL);
+}
+
+static void *client(void *arg)
+{
+	struct sample *s = arg;
+	unsigned int seed = (unsigned int) (uintptr_t) arg;
+	const char *session;
+	mmatic *mm, *rmm;
+	double start, lat;
+	enum op op;
+	int i, w;
+	bool ok;
+
+	mm = mmatic_create();
+	for (op = 0; op < OP_MAX; op++)
+		s->lat[op] = mmatic_alloc(sizeof(double) * opt.ops, mm);
+
+	session = do_login(mm);
+	if (!session) {
+		fprintf(stderr, "fixture user could not log in\n");
+		return NULL;
+	}
+
+	for (i = 0; i < opt.ops; i++) {
+		/* pick request by weight */
+		w = rand_r(&seed) % opt.total;
+		for (op = 0; w >= opt.weights[op]; op++)
+			w -= opt.weights[op];
+
+		rmm = mmatic_create();
+
+		start = now_ms();
+		if (op == OP_LOGIN)
+			ok = (do_login(rmm) != NULL);
+		else
+			ok = do_query(rmm, session, op, &seed);
+		lat = now_ms() - start;
+
+		mmatic_free(rmm);
+
+		if (ok)
+			s->lat[op][s->num[op]++] = lat;
+		else
+			s->errors[op]++;
+	}
+
+	return NULL;
+}
+
+/*****************************************/
+
+static int dblcmp(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static double pct(double *lat, int num, double p)
+{
+	int i;
+
+	i = (int) ceil(p * num) - 1;
+	return lat[i < 0 ? 0 : i];
+}
+
+static void report(struct sample *samples, double elapsed)
+{
+	mmatic *mm = mmatic_create();
+	double *lat;
+	int op, t, num, errors, total = 0;
+
+	printf("%-8s %10s %8s %10s %10s %10s %10s\n",
+		"request", "count", "errors", "req/s", "p50 [ms]", "p99 [ms]", "p999 [ms]");
+
+	for (op = 0; op < OP_MAX; op++) {
+		num = errors = 0;
+		for (t = 0; t < opt.threads; t++) {
+			num += samples[t].num[op];
+			errors += samples[t].errors[op];
+		}
+
+		total += num;
+		if (num == 0 && errors == 0)
+			continue;
+
+		/* merge and sort */
+		lat = mmatic_alloc(sizeof(double) * (num + 1), mm);
+		num = 0;
+		for (t = 0; t < opt.threads; t++) {
+			memcpy(lat + num, samples[t].lat[op], sizeof(double) * samples[t].num[op]);
+			num += samples[t].num[op];
+		}
+		qsort(lat, num, sizeof(double), dblcmp);
+
+		if (num > 0)
+			printf("%-8s %10d %8d %10.0f %10.3f %10.3f %10.3f\n", opnames[op], num, errors,
+				num / elapsed, pct(lat, num, 0.50), pct(lat, num, 0.99), pct(lat, num, 0.999));
+		else
+			printf("%-8s %10d %8d\n", opnames[op], num, errors);
+	}
+
+	printf("\ntotal: %d requests in %.2f s, %.0f req/s\n", total, elapsed, total / elapsed);
+	mmatic_free(mm);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sample *samples;
+	pthread_t *tids;
+	mmatic *mm;
+	double start;
+	int i;
+
+	if (!parse_argv(argc, argv))
+		return 1;
+
+	if (mysql_library_init(0, NULL, NULL) != 0 || !seed() || !load_all())
+		return 1;
+
+	mm = mmatic_create();
+	samples = mmatic_zalloc(sizeof(struct sample) * opt.threads, mm);
+	tids = mmatic_zalloc(sizeof(pthread_t) * opt.threads, mm);
+
+	printf("%d threads x %d requests, %d fixture rows\n\n", opt.threads, opt.ops, opt.rows);
+
+	start = now_ms();
+	for (i = 0; i < opt.threads; i++)
+		pthread_create(&tids[i], NULL, client, &samples[i]);
+	for (i = 0; i < opt.threads; i++)
+		pthread_join(tids[i], NULL);
+
+	report(samples, (now_ms() - start) / 1000.0);
+
+	mmatic_free(mm);
+	return 0;
+}
@@ -5,9 +5,22 @@
  * Licensed under GPLv3
  */
 
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <libpjf/lib.h>
 #include <rpcd/rpcd_module.h>
 #include <mysql/mysql.h>
+#include <mysql/errmsg.h>
 #include "common.h"
 
 /** Construct an error reply along with MySQL error message */
@@ -22,31 +35,1858 @@ bool query(MYSQL *conn, const char *query)
 {
 	asnsert(conn);
 
-	if (mysql_query(conn, query) != 0)
-		die("query '%s' failed: %s", query, mysql_error(conn));
+	if (mysql_query(conn, query) != 0) {
+		dbg(1, "query '%s' failed: %s\n", query, mysql_error(conn));
+		return false;
+	}
+
+	mysql_free_result(mysql_use_result(conn));
+	return true;
+}
+
+MYSQL_RES *query_res(MYSQL *conn, const char *query)
+{
+	MYSQL_RES *res;
+
+	asnsert(conn);
+
+	if (mysql_query(conn, query) != 0) {
+		dbg(1, "query '%s' failed: %s\n", query, mysql_error(conn));
+		return NULL;
+	}
+
+	res = mysql_store_result(conn);
+	if (!res)
+		dbg(1, "query '%s' returned no result: %s\n", query, mysql_error(conn));
+
+	return res;
+}
+
+bool conn_lost(unsigned int code)
+{
+	return code == CR_SERVER_GONE_ERROR || code == CR_SERVER_LOST;
+}
+
+char *escape(MYSQL *conn, xstr *arg)
+{
+	char *buf;
+
+	buf = mmatic_alloc(xstr_length(arg) * 2 + 1, arg);
+	mysql_real_escape_string(conn, buf, xstr_string(arg), xstr_length(arg));
+
+	return buf;
+}
+
+char *get_query(struct req *req, const char *orig_query)
+{
+	size_t i, len;
+	char *query;
+
+	len = strlen(orig_query);
+	i = sizeof SQLER_TAG;
+	if (i > len)
+		return mmatic_strdup("", req);
+
+	/* skip whitechars */
+	for (; orig_query[i]; i++)
+		if (isalpha(orig_query[i]))
+			break;
+
+	/* replace all whitechars, newlines, etc with single space */
+	query = mmatic_alloc(len - i + 1, req);
+	text_squeeze(query, orig_query + i, len - i);
+
+	return query;
+}
+
+bool check_query(struct req *req, const char *orig_query, char **query, struct query **q)
+{
+	thash *queries;
+	ut *v;
+
+	queries = uthp_thash(req->prv, "sqler", "queries");
+
+	*query = get_query(req, orig_query);
+	*q = NULL;
+
+	if (queries) {
+		v = thash_get(queries, *query);
+		if (!v)
+			return err(-EDENY, "Access denied", *query);
+
+		*q = ut_ptr(v);
+	}
+
+	return true;
+}
+
+/****************************************************/
+/**************** Text normalization ****************/
+/****************************************************/
+
+/*
+ * The SSE2 paths look at 16 bytes at a time and copy them as a whole when
+ * nothing has to change; otherwise the chunk goes through the scalar code.
+ */
+
+static char *squeeze(char *d, const char *s, size_t len, bool *inspace)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		switch (s[i]) {
+			case ' ':
+				if (*inspace) continue;
+				*d++ = ' ';
+				*inspace = true;
+				break;
+			case '\t':
+			case '\r':
+			case '\n':
+				break;
+			default:
+				*d++ = s[i];
+				*inspace = false;
+		}
+	}
+
+	return d;
+}
+
+size_t text_squeeze(char *dst, const char *src, size_t len)
+{
+	char *d = dst;
+	size_t i = 0;
+	bool inspace = false;
+#ifdef __SSE2__
+	const __m128i sp = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+	unsigned int spaces, drop;
+	__m128i v;
+
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (src + i));
+		spaces = _mm_movemask_epi8(_mm_cmpeq_epi8(v, sp));
+		drop = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, tab),
+			_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf))));
+
+		/* nothing to drop and no space following another one */
+		if (!drop && !(spaces & ((spaces << 1) | inspace))) {
+			_mm_storeu_si128((__m128i *) d, v);
+			d += 16;
+			inspace = spaces >> 15;
+			continue;
+		}
+
+		d = squeeze(d, src + i, 16, &inspace);
+	}
+#endif
+
+	d = squeeze(d, src + i, len - i, &inspace);
+	*d = '\0';
+	return d - dst;
+}
+
+size_t text_crlf_len(const char *src, size_t len)
+{
+	size_t i = 0, n = len;
+	char last = 0;
+#ifdef __SSE2__
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+	unsigned int crs, lfs;
+	__m128i v;
+
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (src + i));
+		crs = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+		lfs = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+
+		/* LFs not preceded by CR */
+		n += __builtin_popcount(lfs & ~((crs << 1) | (last == '\r')));
+		last = src[i + 15];
+	}
+#endif
+
+	for (; i < len; i++) {
+		if (src[i] == '\n' && last != '\r')
+			n++;
+		last = src[i];
+	}
+
+	return n;
+}
+
+static char *crlf(char *d, const char *s, size_t len, char *last)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (s[i] == '\n' && *last != '\r')
+			*d++ = '\r';
+
+		*d++ = s[i];
+		*last = s[i];
+	}
+
+	return d;
+}
+
+size_t text_crlf(char *dst, const char *src, size_t len)
+{
+	char *d = dst, last = 0;
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i lf = _mm_set1_epi8('\n');
+	__m128i v;
+
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (src + i));
+
+		if (!_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf))) {
+			_mm_storeu_si128((__m128i *) d, v);
+			d += 16;
+			last = src[i + 15];
+			continue;
+		}
+
+		d = crlf(d, src + i, 16, &last);
+	}
+#endif
+
+	d = crlf(d, src + i, len - i, &last);
+	*d = '\0';
+	return d - dst;
+}
+
+static char *json(char *d, const char *s, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		c = s[i];
+
+		switch (c) {
+			case '"':  *d++ = '\\'; *d++ = '"';  break;
+			case '\\': *d++ = '\\'; *d++ = '\\'; break;
+			case '\n': *d++ = '\\'; *d++ = 'n';  break;
+			case '\r': *d++ = '\\'; *d++ = 'r';  break;
+			case '\t': *d++ = '\\'; *d++ = 't';  break;
+			default:
+				if (c < 0x20) {
+					memcpy(d, "\\u00", 4);
+					d[4] = hex[c >> 4];
+					d[5] = hex[c & 15];
+					d += 6;
+				} else {
+					*d++ = c;
+				}
+		}
+	}
+
+	return d;
+}
+
+size_t text_json(char *dst, const char *src, size_t len)
+{
+	char *d = dst;
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i bslash = _mm_set1_epi8('\\');
+	const __m128i ctl = _mm_set1_epi8(0x1f);
+	__m128i v, m;
+
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (src + i));
+
+		/* unsigned v <= 0x1f iff max(v, 0x1f) == 0x1f */
+		m = _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, ctl), ctl),
+			_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)));
+
+		if (!_mm_movemask_epi8(m)) {
+			_mm_storeu_si128((__m128i *) d, v);
+			d += 16;
+			continue;
+		}
+
+		d = json(d, src + i, 16);
+	}
+#endif
+
+	d = json(d, src + i, len - i);
+	*d = '\0';
+	return d - dst;
+}
+
+/****************************************************/
+/****************** Request memory ******************/
+/****************************************************/
+
+/** Allocation counters, for stats_reply() */
+static struct {
+	unsigned long chunks;        /** arena chunks allocated */
+	unsigned long large;         /** arena allocations too big for a chunk */
+	unsigned long bytes;         /** bytes served by arenas */
+	unsigned long grows;         /** per-thread buffer reallocations */
+	unsigned long reuses;        /** per-thread buffer uses without reallocation */
+} allocs;
+
+#define allocs_add(counter, val) __atomic_fetch_add(&allocs.counter, (val), __ATOMIC_RELAXED)
+
+/** Request arena, kept at start of its first chunk */
+struct arena {
+	char *pos;                   /** next free byte */
+	char *end;                   /** end of current chunk */
+};
+
+void *arena_alloc(struct req *req, size_t size)
+{
+	struct arena *a;
+	char *chunk, *pos;
+	ut *reqprv;
+	void *ret;
+
+	size = (size + 15) & ~(size_t) 15;
+
+	if (size > SQLER_ARENA_CHUNK / 4) {
+		allocs_add(large, 1);
+		return mmatic_alloc(size, req);
+	}
+
+	reqprv = uth_path_create(req->prv, "sqler");
+	a = uth_ptr(reqprv, "arena");
+
+	if (!a || a->pos + size > a->end) {
+		chunk = pos = mmatic_alloc(SQLER_ARENA_CHUNK, req);
+		allocs_add(chunks, 1);
+
+		if (!a) {
+			a = (struct arena *) chunk;
+			pos += (sizeof *a + 15) & ~(size_t) 15;
+			uth_set_ptr(reqprv, "arena", a);
+		}
+
+		a->pos = pos;
+		a->end = chunk + SQLER_ARENA_CHUNK;
+	}
+
+	ret = a->pos;
+	a->pos += size;
+	allocs_add(bytes, size);
+
+	return ret;
+}
+
+char *tbuf_get(struct tbuf *b, size_t size)
+{
+	if (size <= b->size) {
+		allocs_add(reuses, 1);
+		return b->buf;
+	}
+
+	/* grow at least twice, so it settles quickly */
+	if (size < b->size * 2)
+		size = b->size * 2;
+
+	/* not in any mmatic: lives as long as the thread */
+	free(b->buf);
+	b->buf = malloc(size);
+	if (!b->buf)
+		die("out of memory");
+
+	b->size = size;
+	allocs_add(grows, 1);
+
+	return b->buf;
+}
+
+/****************************************************/
+/***************** Connection pool ******************/
+/****************************************************/
+
+/* marks SQL that failed to prepare, see stmt_get() */
+static char stmt_failed;
+
+/** Open new MySQL connection for given pool
+ * @note does not touch pool state */
+static MYSQL *conn_open(struct dbpool *pool)
+{
+	MYSQL *conn;
+
+	conn = mysql_init(NULL);
+	if (!conn) {
+		dbg(0, "initialization of MySQL client library failed\n");
+		return NULL;
+	}
+
+#ifdef LIBMARIADB
+	/* blocking calls keep working, see async_run() */
+	mysql_options(conn, MYSQL_OPT_NONBLOCK, 0);
+#endif
+
+	if (!mysql_real_connect(conn, pool->host, pool->user, pool->pass, pool->db, 0, NULL, 0)) {
+		dbg(0, "role %s: database connection failed: %s\n", pool->role, mysql_error(conn));
+		mysql_close(conn);
+		return NULL;
+	}
+
+	if (!query(conn, "SET NAMES 'binary'")) {
+		mysql_close(conn);
+		return NULL;
+	}
+
+	dbg(8, "role %s: connected to database\n", pool->role);
+	return conn;
+}
+
+/** Wrap MySQL handle into a pooled connection
+ * @note call with pool->lock held */
+static struct dbconn *conn_wrap(struct dbpool *pool, MYSQL *mysql)
+{
+	struct dbconn *conn;
+
+	conn = mmatic_zalloc(sizeof *conn, pool->mm);
+	conn->mm = mmatic_create();
+	conn->mysql = mysql;
+	conn->pool = pool;
+	conn->stmts = thash_create_strkey(NULL, conn->mm);
+	conn->used = time(NULL);
+
+	return conn;
+}
+
+/** Note result of connection attempt
+ * @note call with pool->lock held */
+static void pool_connected(struct dbpool *pool, bool ok)
+{
+	if (ok) {
+		if (pool->fails > 0)
+			dbg(1, "role %s: connected to %s again\n", pool->role, pool->host);
+		pool->fails = 0;
+	} else {
+		pool->fails++;
+		pool->down = time(NULL);
+	}
+}
+
+/** Check if connecting should wait, after failed attempts
+ * @note call with pool->lock held */
+static bool pool_backoff(struct dbpool *pool)
+{
+	int delay;
+
+	if (pool->fails == 0)
+		return false;
+
+	delay = pool->fails < 16 ? 1 << (pool->fails - 1) : SQLER_RECONNECT_MAX;
+	if (delay > SQLER_RECONNECT_MAX)
+		delay = SQLER_RECONNECT_MAX;
+
+	return time(NULL) - pool->down < delay;
+}
+
+/** Check connection taken from idle list, drop it if broken
+ * @retval false      connection was dropped */
+static bool conn_check(struct dbconn *conn)
+{
+	if (time(NULL) - conn->used < SQLER_PING_IDLE)
+		return true;
+
+	if (mysql_ping(conn->mysql) == 0)
+		return true;
+
+	dbg(1, "role %s: idle connection broken: %s\n", conn->pool->role, mysql_error(conn->mysql));
+	pool_drop(conn);
+	return false;
+}
+
+/** Thread opening one connection at startup, see pool_fill() */
+static void *pool_fill_thread(void *arg)
+{
+	struct dbpool *pool = arg;
+	MYSQL *mysql;
+
+	mysql_thread_init();
+	mysql = conn_open(pool);
+
+	pthread_mutex_lock(&pool->lock);
+	if (mysql) {
+		tlist_push(pool->idle, conn_wrap(pool, mysql));
+		pool->size++;
+	}
+	pool_connected(pool, mysql != NULL);
+	pthread_mutex_unlock(&pool->lock);
+
+	mysql_thread_end();
+	return NULL;
+}
+
+/** Open min connections of all pools in parallel
+ * @retval false      some pool did not reach its min size */
+static bool pool_fill(tlist *pools)
+{
+	struct dbpool *pool;
+	tlist *threads;
+	pthread_t *th;
+	int i;
+	bool ret = true;
+
+	threads = tlist_create(NULL, pools);
+
+	TLIST_ITER_LOOP(pools, pool) {
+		for (i = 0; i < pool->min; i++) {
+			th = mmatic_alloc(sizeof *th, threads);
+			if (pthread_create(th, NULL, pool_fill_thread, pool) != 0) {
+				dbg(0, "role %s: could not start connection thread\n", pool->role);
+				ret = false;
+				break;
+			}
+
+			tlist_push(threads, th);
+		}
+	}
+
+	TLIST_ITER_LOOP(threads, th)
+		pthread_join(*th, NULL);
+
+	TLIST_ITER_LOOP(pools, pool) {
+		if (pool->size < pool->min) {
+			dbg(0, "role %s: opened %d of %d connections\n", pool->role, pool->size, pool->min);
+			ret = false;
+		}
+	}
+
+	tlist_free(threads);
+	return ret;
+}
+
+/** Create connection pool for given role
+ * @param host        database host */
+static struct dbpool *pool_create(ut *cfg, const char *rolename, ut *dbuser, const char *host)
+{
+	struct dbpool *pool;
+	mmatic *mm;
+
+	mm = mmatic_create();
+	pool = mmatic_zalloc(sizeof *pool, mm);
+	pool->mm = mm;
+
+	pool->role = mmatic_strdup(rolename, mm);
+	pool->host = host;
+	pool->db   = uth_char(cfg, "dbname");
+	pool->user = uth_char(dbuser, "user");
+	pool->pass = uth_char(dbuser, "pass");
+
+	/* role settings override global ones */
+	pool->min = uth_get(dbuser, "pool-min") ? uth_int(dbuser, "pool-min") :
+	            uth_get(cfg, "pool-min") ? uth_int(cfg, "pool-min") : SQLER_POOL_MIN;
+	pool->max = uth_get(dbuser, "pool-max") ? uth_int(dbuser, "pool-max") :
+	            uth_get(cfg, "pool-max") ? uth_int(cfg, "pool-max") : SQLER_POOL_MAX;
+
+	pool->timeout = uth_get(dbuser, "timeout") ? uth_int(dbuser, "timeout") : uth_int(cfg, "timeout");
+
+	if (pool->max < 1)
+		pool->max = 1;
+	if (pool->min > pool->max)
+		pool->min = pool->max;
+
+	pool->idle = tlist_create(NULL, mm);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	return pool;
+}
+
+struct dbconn *pool_get(struct dbpool *pool)
+{
+	struct dbconn *conn;
+	struct timespec deadline;
+	MYSQL *mysql;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += SQLER_POOL_WAIT;
+
+again:
+	pthread_mutex_lock(&pool->lock);
+
+	while (!(conn = tlist_shift(pool->idle))) {
+		if (pool->size < pool->max && !pool_backoff(pool)) {
+			/* grow - reserve the slot and connect without holding the lock */
+			pool->size++;
+			pthread_mutex_unlock(&pool->lock);
+
+			mysql = conn_open(pool);
+
+			pthread_mutex_lock(&pool->lock);
+			pool_connected(pool, mysql != NULL);
+			if (mysql) {
+				conn = conn_wrap(pool, mysql);
+				dbg(5, "role %s: pool grown to %d connections\n", pool->role, pool->size);
+			} else {
+				pool->size--;
+			}
+			break;
+		}
+
+		/* no connection to wait for */
+		if (pool->size == 0) {
+			dbg(1, "role %s: database unreachable, waiting before next attempt\n", pool->role);
+			break;
+		}
+
+		if (pthread_cond_timedwait(&pool->cond, &pool->lock, &deadline) != 0) {
+			dbg(1, "role %s: connection pool exhausted\n", pool->role);
+			break;
+		}
+	}
+
+	if (!conn) {
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+
+	pool->busy++;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!conn_check(conn))
+		goto again;
+
+	return conn;
+}
+
+struct dbconn *pool_tryget(struct dbpool *pool)
+{
+	struct dbconn *conn;
+	MYSQL *mysql;
+
+again:
+	pthread_mutex_lock(&pool->lock);
+
+	conn = tlist_shift(pool->idle);
+	if (conn) {
+		pool->busy++;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (!conn_check(conn))
+			goto again;
+
+		return conn;
+	}
+
+	if (pool->size >= pool->max || pool_backoff(pool)) {
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+
+	/* grow */
+	pool->size++;
+	pthread_mutex_unlock(&pool->lock);
+
+	mysql = conn_open(pool);
+
+	pthread_mutex_lock(&pool->lock);
+	pool_connected(pool, mysql != NULL);
+	if (mysql) {
+		conn = conn_wrap(pool, mysql);
+		pool->busy++;
+	} else {
+		pool->size--;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return conn;
+}
+
+void pool_put(struct dbconn *conn)
+{
+	struct dbpool *pool = conn->pool;
+
+	/* do not keep connections known to be broken */
+	if (conn_lost(mysql_errno(conn->mysql))) {
+		dbg(1, "role %s: connection lost: %s\n", pool->role, mysql_error(conn->mysql));
+		pool_drop(conn);
+		return;
+	}
+
+	conn->used = time(NULL);
+
+	pthread_mutex_lock(&pool->lock);
+	tlist_push(pool->idle, conn);
+	pool->busy--;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_drop(struct dbconn *conn)
+{
+	struct dbpool *pool = conn->pool;
+	MYSQL_STMT *stmt;
+	const char *sql;
+
+	THASH_ITER_LOOP(conn->stmts, sql, stmt) {
+		if (stmt != (void *) &stmt_failed)
+			mysql_stmt_close(stmt);
+	}
+
+	mysql_close(conn->mysql);
+	mmatic_free(conn->mm);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->size--;
+	pool->busy--;
+	mmatic_freeptr(conn);
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	dbg(5, "role %s: connection dropped, %d left\n", pool->role, pool->size);
+}
+
+MYSQL *conn_get(struct req *req)
+{
+	struct dbconn *conn;
+	struct dbpool *pool;
+	ut *reqprv;
+
+	reqprv = uth_path_create(req->prv, "sqler");
+
+	conn = uth_ptr(reqprv, "dbconn");
+	if (conn)
+		return conn->mysql;
+
+	pool = uth_ptr(reqprv, "pool");
+	if (!pool)
+		return NULL;
+
+	conn = pool_get(pool);
+	if (!conn)
+		return NULL;
+
+	uth_set_ptr(reqprv, "dbconn", conn);
+	uth_set_ptr(reqprv, "conn", conn->mysql);
+	return conn->mysql;
+}
+
+void conn_put(struct req *req)
+{
+	struct dbconn *conn;
+	ut *reqprv;
+
+	reqprv = uth_path_create(req->prv, "sqler");
+
+	conn = uth_ptr(reqprv, "dbconn");
+	if (!conn)
+		return;
+
+	uth_set_ptr(reqprv, "dbconn", NULL);
+	uth_set_ptr(reqprv, "conn", NULL);
+	pool_put(conn);
+}
+
+void conn_drop(struct req *req)
+{
+	struct dbconn *conn;
+
+	conn = conn_detach(req);
+	if (conn)
+		pool_drop(conn);
+}
+
+/*
+ * A reader announces itself in readers[epoch] before loading cur, so the
+ * table it loads cannot be released until it is pinned. The publisher swaps
+ * cur, flips the epoch and waits only for readers of the previous epoch:
+ * these are a few instructions away from pinning, new ones count elsewhere.
+ * A reader that saw the epoch change under it starts over.
+ */
+struct qtable *qtable_get(struct qslot *slot)
+{
+	struct qtable *t;
+	int e;
+
+	while (true) {
+		e = __atomic_load_n(&slot->epoch, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&slot->readers[e], 1, __ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&slot->epoch, __ATOMIC_SEQ_CST) == e)
+			break;
+
+		__atomic_sub_fetch(&slot->readers[e], 1, __ATOMIC_RELEASE);
+	}
+
+	t = __atomic_load_n(&slot->cur, __ATOMIC_SEQ_CST);
+	if (t)
+		__atomic_add_fetch(&t->refs, 1, __ATOMIC_RELAXED);
+
+	__atomic_sub_fetch(&slot->readers[e], 1, __ATOMIC_RELEASE);
+	return t;
+}
+
+void qtable_publish(struct qslot *slot, struct qtable *t)
+{
+	struct qtable *old;
+	int e;
+
+	old = __atomic_exchange_n(&slot->cur, t, __ATOMIC_SEQ_CST);
+	e = __atomic_fetch_xor(&slot->epoch, 1, __ATOMIC_SEQ_CST);
+
+	while (__atomic_load_n(&slot->readers[e], __ATOMIC_ACQUIRE) > 0)
+		sched_yield();
+
+	/* freed when the last request using it is done */
+	if (old)
+		qtable_unref(old);
+}
+
+void qtable_unref(struct qtable *t)
+{
+	if (__atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		t->release(t);
+}
+
+void qtable_pin(struct req *req)
+{
+	struct qslot *slot;
+	struct qtable *t;
+	ut *reqprv;
+
+	reqprv = uth_path_create(req->prv, "sqler");
+
+	slot = uth_ptr(reqprv, "qslot");
+	if (!slot || uth_ptr(reqprv, "qtable"))
+		return;
+
+	t = qtable_get(slot);
+	if (!t)
+		return;
+
+	uth_set_ptr(reqprv, "qtable", t);
+	uth_set_thash(reqprv, "queries", t->queries);
+}
+
+void qtable_put(struct req *req)
+{
+	struct qtable *t;
+	ut *reqprv;
+
+	reqprv = uth_path_create(req->prv, "sqler");
+
+	t = uth_ptr(reqprv, "qtable");
+	if (!t)
+		return;
+
+	uth_set_ptr(reqprv, "qtable", NULL);
+	qtable_unref(t);
+}
+
+/** Find least loaded replica of pool, skipping those recently unreachable
+ * @retval NULL       no replica available */
+static struct dbpool *pool_replica(struct dbpool *pool)
+{
+	struct dbpool *best = NULL, *r;
+	time_t now = time(NULL);
+	int i;
+
+	for (i = 0; i < pool->nreplicas; i++) {
+		r = pool->replicas[i];
+		if (now - __atomic_load_n(&r->down, __ATOMIC_RELAXED) < SQLER_REPLICA_RETRY)
+			continue;
+
+		/* approximate, no need to lock */
+		if (!best || __atomic_load_n(&r->busy, __ATOMIC_RELAXED) < __atomic_load_n(&best->busy, __ATOMIC_RELAXED))
+			best = r;
+	}
+
+	return best;
+}
+
+static bool session_sticky(ut *dirprv, const char *id);
+static void session_wrote(ut *dirprv, const char *id);
+
+MYSQL *conn_route(struct req *req, bool read)
+{
+	struct dbconn *conn;
+	struct dbpool *pool, *replica;
+	const char *session;
+	ut *reqprv, *dirprv;
+
+	reqprv = uth_path_create(req->prv, "sqler");
+	pool = uth_ptr(reqprv, "pool");
+	conn = uth_ptr(reqprv, "dbconn");
+
+	if (conn) {
+		/* once on the primary, stay there for the rest of request */
+		if (read || conn->pool == pool)
+			return conn->mysql;
+
+		conn_put(req);
+	}
+
+	if (!pool || pool->nreplicas == 0)
+		return conn_get(req);
+
+	dirprv = uth_path_create(req->mod->dir->prv, "sqler");
+	session = uth_char(req->params, "session");
+
+	if (!read) {
+		if (session)
+			session_wrote(dirprv, session);
+		return conn_get(req);
+	}
+
+	if (session && session_sticky(dirprv, session))
+		return conn_get(req);
+
+	replica = pool_replica(pool);
+	if (!replica || !(conn = pool_tryget(replica)))
+		return conn_get(req);
+
+	uth_set_ptr(reqprv, "dbconn", conn);
+	uth_set_ptr(reqprv, "conn", conn->mysql);
+	return conn->mysql;
+}
+
+struct dbconn *conn_detach(struct req *req)
+{
+	struct dbconn *conn;
+	ut *reqprv;
+
+	reqprv = uth_path_create(req->prv, "sqler");
+
+	conn = uth_ptr(reqprv, "dbconn");
+	uth_set_ptr(reqprv, "dbconn", NULL);
+	uth_set_ptr(reqprv, "conn", NULL);
+
+	return conn;
+}
+
+/****************************************************/
+/**************** Non-blocking queries **************/
+/****************************************************/
+
+/* stages of struct aquery */
+#define AQ_WAITING 0          /* waits for its connection */
+#define AQ_QUERY   1          /* query sent */
+#define AQ_STORE   2          /* reading result set */
+#define AQ_DONE    3
+
+/** Record outcome of finished query */
+static void async_done(struct aquery *aq, void *mm)
+{
+	MYSQL *mysql = aq->conn->mysql;
+
+	aq->stage = AQ_DONE;
+	aq->status = 0;
+
+	aq->errcode = mysql_errno(mysql);
+	if (aq->errcode) {
+		aq->error = mmatic_strdup(mysql_error(mysql), mm);
+	} else if (!aq->res) {
+		aq->insert_id = mysql_insert_id(mysql);
+		aq->affected = mysql_affected_rows(mysql);
+	}
+}
+
+#ifdef LIBMARIADB
+/** Advance query as far as possible without blocking
+ * @param events      MYSQL_WAIT_* events that occurred, 0 to start a stage */
+static void async_step(struct aquery *aq, int events, void *mm)
+{
+	MYSQL *mysql = aq->conn->mysql;
+
+	if (aq->stage == AQ_WAITING) {
+		aq->stage = AQ_QUERY;
+		aq->status = mysql_real_query_start(&aq->rc, mysql, aq->sql, strlen(aq->sql));
+	} else if (aq->stage == AQ_QUERY) {
+		aq->status = mysql_real_query_cont(&aq->rc, mysql, events);
+	} else if (aq->stage == AQ_STORE) {
+		aq->status = mysql_store_result_cont(&aq->res, mysql, events);
+	}
+
+	if (aq->status)
+		return;
+
+	if (aq->stage == AQ_QUERY) {
+		if (aq->rc != 0) {
+			async_done(aq, mm);
+			return;
+		}
+
+		aq->stage = AQ_STORE;
+		aq->status = mysql_store_result_start(&aq->res, mysql);
+		if (aq->status)
+			return;
+	}
+
+	async_done(aq, mm);
+}
+
+void async_run(struct aquery **queries, int num, void *mm)
+{
+	struct pollfd *pfd;
+	struct aquery **polled, *aq;
+	int i, j, n, timeout, events, left = num;
+	bool busy;
+
+	pfd = mmatic_alloc(sizeof(struct pollfd) * (num + 1), mm);
+	polled = mmatic_alloc(sizeof(struct aquery *) * (num + 1), mm);
+
+	while (left > 0) {
+		/* start queries whose connections are free */
+		for (i = 0; i < num; i++) {
+			if (queries[i]->stage != AQ_WAITING)
+				continue;
+
+			busy = false;
+			for (j = 0; j < i && !busy; j++) {
+				if (queries[j]->conn == queries[i]->conn && queries[j]->stage != AQ_DONE)
+					busy = true;
+			}
+
+			if (!busy)
+				async_step(queries[i], 0, mm);
+		}
+
+		/* wait for any of running queries */
+		n = 0;
+		timeout = -1;
+		left = 0;
+		for (i = 0; i < num; i++) {
+			aq = queries[i];
+			if (aq->stage == AQ_DONE)
+				continue;
+
+			left++;
+			if (!aq->status)
+				continue;
+
+			pfd[n].fd = mysql_get_socket(aq->conn->mysql);
+			pfd[n].events =
+				(aq->status & MYSQL_WAIT_READ ? POLLIN : 0) |
+				(aq->status & MYSQL_WAIT_WRITE ? POLLOUT : 0) |
+				(aq->status & MYSQL_WAIT_EXCEPT ? POLLPRI : 0);
+			pfd[n].revents = 0;
+
+			if (aq->status & MYSQL_WAIT_TIMEOUT) {
+				j = mysql_get_timeout_value_ms(aq->conn->mysql);
+				if (timeout < 0 || j < timeout)
+					timeout = j;
+			}
+
+			polled[n++] = aq;
+		}
+
+		if (n == 0)
+			continue;
+
+		if (poll(pfd, n, timeout) < 0 && errno != EINTR)
+			die("poll() failed: %s", strerror(errno));
+
+		for (i = 0; i < n; i++) {
+			events =
+				(pfd[i].revents & (POLLIN | POLLHUP | POLLERR) ? MYSQL_WAIT_READ : 0) |
+				(pfd[i].revents & POLLOUT ? MYSQL_WAIT_WRITE : 0) |
+				(pfd[i].revents & POLLPRI ? MYSQL_WAIT_EXCEPT : 0);
+
+			if (!events && (polled[i]->status & MYSQL_WAIT_TIMEOUT))
+				events = MYSQL_WAIT_TIMEOUT;
+
+			if (events)
+				async_step(polled[i], events, mm);
+		}
+	}
+}
+#else
+void async_run(struct aquery **queries, int num, void *mm)
+{
+	struct aquery *aq;
+	int i;
+
+	/* no non-blocking API: just execute in order */
+	for (i = 0; i < num; i++) {
+		aq = queries[i];
+		aq->stage = AQ_QUERY;
+
+		if (mysql_query(aq->conn->mysql, aq->sql) == 0)
+			aq->res = mysql_store_result(aq->conn->mysql);
+
+		async_done(aq, mm);
+	}
+}
+#endif
+
+MYSQL_STMT *stmt_get(struct req *req, const char *sql)
+{
+	struct dbconn *conn;
+	MYSQL_STMT *stmt;
+
+	if (!conn_get(req))
+		return NULL;
+
+	conn = uthp_ptr(req->prv, "sqler", "dbconn");
+
+	stmt = thash_get(conn->stmts, sql);
+	if (stmt == (void *) &stmt_failed)
+		return NULL;
+	else if (stmt)
+		return stmt;
+
+	stmt = mysql_stmt_init(conn->mysql);
+	if (!stmt)
+		return NULL;
+
+	if (mysql_stmt_prepare(stmt, sql, strlen(sql)) != 0) {
+		dbg(3, "role %s: preparing '%s' failed: %s\n", conn->pool->role, sql, mysql_stmt_error(stmt));
+		mysql_stmt_close(stmt);
+		thash_set(conn->stmts, mmatic_strdup(sql, conn->mm), &stmt_failed);
+		return NULL;
+	}
+
+	dbg(8, "role %s: prepared '%s'\n", conn->pool->role, sql);
+	thash_set(conn->stmts, mmatic_strdup(sql, conn->mm), stmt);
+	return stmt;
+}
+
+/****************************************************/
+/****************** Query deadlines *****************/
+/****************************************************/
+
+enum { DL_OFF, DL_WAIT, DL_KILLING, DL_KILLED };
+
+/** Watchdog killing queries past their deadline */
+static struct {
+	pthread_mutex_t lock;        /** protects everything below */
+	pthread_cond_t wake;         /** signaled on new deadline, waited on by watchdog */
+	pthread_cond_t done;         /** signaled on finished kill */
+	mmatic *mm;                  /** memory for active */
+	tlist *active;               /** struct deadline being watched */
+	bool started;                /** watchdog thread running */
+} watchdog = { .lock = PTHREAD_MUTEX_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+
+/** Kill query through side connection of pool */
+static void kill_query(struct deadline *d)
+{
+	struct dbpool *pool = d->pool;
+	char sql[64];
+	int i;
+
+	snprintf(sql, sizeof sql, "KILL QUERY %lu", d->thread);
+
+	/* reconnect once if side connection went away */
+	for (i = 0; i < 2; i++) {
+		if (!pool->killer && !(pool->killer = conn_open(pool)))
+			break;
+
+		if (mysql_query(pool->killer, sql) == 0) {
+			dbg(1, "role %s: query timed out, killed thread %lu\n", pool->role, d->thread);
+			return;
+		}
+
+		dbg(1, "role %s: %s failed: %s\n", pool->role, sql, mysql_error(pool->killer));
+
+		/* server-side error, connection is fine */
+		if (mysql_errno(pool->killer) < 2000)
+			return;
+
+		mysql_close(pool->killer);
+		pool->killer = NULL;
+	}
+}
+
+static void *watchdog_thread(void *arg)
+{
+	struct deadline *d, *next;
+	struct timespec ts;
+
+	mysql_thread_init();
+	pthread_mutex_lock(&watchdog.lock);
+
+	while (true) {
+		next = NULL;
+		TLIST_ITER_LOOP(watchdog.active, d) {
+			if (d->state == DL_WAIT && (!next || d->at < next->at))
+				next = d;
+		}
+
+		if (!next) {
+			pthread_cond_wait(&watchdog.wake, &watchdog.lock);
+			continue;
+		}
+
+		if (stats_clock() < next->at) {
+			ts.tv_sec = next->at / 1000000000;
+			ts.tv_nsec = next->at % 1000000000;
+			pthread_cond_timedwait(&watchdog.wake, &watchdog.lock, &ts);
+			continue;
+		}
+
+		/* kill without holding the lock, deadline_stop() waits for us */
+		next->state = DL_KILLING;
+		pthread_mutex_unlock(&watchdog.lock);
 
-	mysql_free_result(mysql_use_result(conn));
+		kill_query(next);
+
+		pthread_mutex_lock(&watchdog.lock);
+		next->state = DL_KILLED;
+		pthread_cond_broadcast(&watchdog.done);
+	}
+
+	return NULL;
+}
+
+void deadline_start(struct deadline *d, struct dbconn *conn, int ms)
+{
+	pthread_condattr_t attr;
+	pthread_t tid;
+
+	memset(d, 0, sizeof *d);
+	if (ms <= 0)
+		return;
+
+	d->pool = conn->pool;
+	d->thread = mysql_thread_id(conn->mysql);
+	d->at = stats_clock() + (uint64_t) ms * 1000000;
+	d->state = DL_WAIT;
+
+	pthread_mutex_lock(&watchdog.lock);
+
+	if (!watchdog.mm) {
+		/* deadlines are in stats_clock() time */
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&watchdog.wake, &attr);
+		pthread_condattr_destroy(&attr);
+
+		watchdog.mm = mmatic_create();
+		watchdog.active = tlist_create(NULL, watchdog.mm);
+	}
+
+	if (!watchdog.started) {
+		if (pthread_create(&tid, NULL, watchdog_thread, NULL) != 0) {
+			dbg(0, "could not start query watchdog, timeouts disabled\n");
+			d->state = DL_OFF;
+			pthread_mutex_unlock(&watchdog.lock);
+			return;
+		}
+
+		pthread_detach(tid);
+		watchdog.started = true;
+	}
+
+	tlist_push(watchdog.active, d);
+	pthread_cond_signal(&watchdog.wake);
+	pthread_mutex_unlock(&watchdog.lock);
+}
+
+bool deadline_stop(struct deadline *d)
+{
+	struct deadline *a;
+	bool killed;
+
+	if (d->state == DL_OFF)
+		return false;
+
+	pthread_mutex_lock(&watchdog.lock);
+
+	while (d->state == DL_KILLING)
+		pthread_cond_wait(&watchdog.done, &watchdog.lock);
+
+	TLIST_ITER_LOOP(watchdog.active, a) {
+		if (a == d) {
+			tlist_remove(watchdog.active);
+			break;
+		}
+	}
+
+	killed = (d->state == DL_KILLED);
+	d->state = DL_OFF;
+
+	pthread_mutex_unlock(&watchdog.lock);
+	return killed;
+}
+
+/****************************************************/
+/******************** Statistics ********************/
+/****************************************************/
+
+static const char *stages[ST_MAX] = { "session", "fill", "query", "fetch", "reply" };
+
+/** All statistics entries */
+static struct {
+	pthread_mutex_t lock;        /** protects entries */
+	mmatic *mm;                  /** memory for entries */
+	thash *entries;              /** role + query -> struct stats */
+	int interval;                /** how often to dump [s], 0 if never */
+	time_t dumped;               /** time of last dump */
+} stats = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+uint64_t stats_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Find histogram bucket of value */
+static int hist_bucket(uint64_t v)
+{
+	int msb, i;
+
+	if (v < HIST_SUB)
+		return v;
+
+	if (v > UINT32_MAX)
+		v = UINT32_MAX;
+
+	/* HIST_SUB linear steps between powers of two */
+	msb = 63 - __builtin_clzll(v);
+	i = (msb - 1) * HIST_SUB + (v >> (msb - 2)) - HIST_SUB;
+
+	return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+/** Lowest value in histogram bucket */
+static unsigned long hist_value(int i)
+{
+	if (i < HIST_SUB)
+		return i;
+
+	return (unsigned long) (HIST_SUB + i % HIST_SUB) << (i / HIST_SUB - 1);
+}
+
+/** Approximate percentile of histogram [us] */
+static unsigned long hist_pct(struct hist *h, double p)
+{
+	unsigned long n, seen = 0;
+	int i;
+
+	n = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	if (n == 0)
+		return 0;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+		if (seen >= p * n)
+			return hist_value(i);
+	}
+
+	return h->max;
+}
+
+static void hist_add(struct hist *h, uint64_t us)
+{
+	unsigned long max;
+
+	__atomic_fetch_add(&h->buckets[hist_bucket(us)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while (us > max && !__atomic_compare_exchange_n(&h->max, &max, us, true,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+struct stats *stats_get(const char *role, const char *query)
+{
+	struct stats *s;
+	char *key;
+
+	pthread_mutex_lock(&stats.lock);
+
+	if (!stats.mm) {
+		stats.mm = mmatic_create();
+		stats.entries = thash_create_strkey(NULL, stats.mm);
+	}
+
+	/* do not grow without limit on ad-hoc queries */
+	if (query && thash_count(stats.entries) >= SQLER_STATS_MAX)
+		query = "(other)";
+
+	key = mmatic_printf(stats.mm, "%s\n%s", role, query ? query : "");
+	s = thash_get(stats.entries, key);
+	if (s) {
+		mmatic_freeptr(key);
+	} else {
+		s = mmatic_zalloc(sizeof *s, stats.mm);
+		s->role = mmatic_strdup(role, stats.mm);
+		if (query)
+			s->query = mmatic_strdup(query, stats.mm);
+		thash_set(stats.entries, key, s);
+	}
+
+	pthread_mutex_unlock(&stats.lock);
+	return s;
+}
+
+void stats_time(struct stats *s, enum stage st, uint64_t ns)
+{
+	hist_add(&s->stages[st], ns / 1000);
+}
+
+static void stats_zero(unsigned long *v)
+{
+	__atomic_store_n(v, 0, __ATOMIC_RELAXED);
+}
+
+void stats_reply(ut *reply, bool reset)
+{
+	struct stats *s;
+	struct hist *h;
+	const char *key;
+	ut *list, *item, *st;
+	int i, j;
+
+	list = uth_set_tlist(reply, "stats", NULL);
+
+	st = uth_path_create(reply, "memory");
+	uth_set_int(st, "arena_chunks", allocs.chunks);
+	uth_set_int(st, "arena_large", allocs.large);
+	uth_set_int(st, "arena_bytes", allocs.bytes);
+	uth_set_int(st, "buffer_grows", allocs.grows);
+	uth_set_int(st, "buffer_reuses", allocs.reuses);
+
+	pthread_mutex_lock(&stats.lock);
+	if (!stats.entries)
+		goto end;
+
+	THASH_ITER_LOOP(stats.entries, key, s) {
+		item = utl_add_thash(list, NULL);
+		uth_set_char(item, "role", s->role);
+		if (s->query)
+			uth_set_char(item, "query", s->query);
+
+		uth_set_int(item, "calls", s->calls);
+		uth_set_int(item, "errors", s->errors);
+		uth_set_int(item, "cached", s->cached);
+		uth_set_int(item, "coalesced", s->coalesced);
+		uth_set_int(item, "rows", s->rows);
+		uth_set_int(item, "bytes", s->bytes);
+
+		/* times in microseconds */
+		for (i = 0; i < ST_MAX; i++) {
+			h = &s->stages[i];
+			if (h->count == 0)
+				continue;
+
+			st = uth_path_create(item, "stages", stages[i]);
+			uth_set_int(st, "count", h->count);
+			uth_set_int(st, "avg", h->sum / h->count);
+			uth_set_int(st, "p50", hist_pct(h, 0.50));
+			uth_set_int(st, "p99", hist_pct(h, 0.99));
+			uth_set_int(st, "p999", hist_pct(h, 0.999));
+			uth_set_int(st, "max", h->max);
+		}
+
+		if (!reset)
+			continue;
+
+		stats_zero(&s->calls);
+		stats_zero(&s->errors);
+		stats_zero(&s->cached);
+		stats_zero(&s->coalesced);
+		stats_zero(&s->rows);
+		stats_zero(&s->bytes);
+		for (i = 0; i < ST_MAX; i++) {
+			h = &s->stages[i];
+			stats_zero(&h->count);
+			stats_zero(&h->sum);
+			stats_zero(&h->max);
+			for (j = 0; j < HIST_BUCKETS; j++)
+				stats_zero(&h->buckets[j]);
+		}
+	}
+
+end:
+	if (reset) {
+		stats_zero(&allocs.chunks);
+		stats_zero(&allocs.large);
+		stats_zero(&allocs.bytes);
+		stats_zero(&allocs.grows);
+		stats_zero(&allocs.reuses);
+	}
+
+	pthread_mutex_unlock(&stats.lock);
+}
+
+void stats_dump(void)
+{
+	struct stats *s;
+	struct hist *h;
+	const char *key;
+	time_t now = time(NULL);
+	int i;
+
+	if (stats.interval <= 0 || now - __atomic_load_n(&stats.dumped, __ATOMIC_RELAXED) < stats.interval)
+		return;
+
+	pthread_mutex_lock(&stats.lock);
+
+	/* someone was first */
+	if (now - stats.dumped < stats.interval || !stats.entries) {
+		pthread_mutex_unlock(&stats.lock);
+		return;
+	}
+	stats.dumped = now;
+
+	dbg(1, "stats: memory: arena chunks=%lu large=%lu bytes=%lu, buffer grows=%lu reuses=%lu\n",
+		allocs.chunks, allocs.large, allocs.bytes, allocs.grows, allocs.reuses);
+
+	THASH_ITER_LOOP(stats.entries, key, s) {
+		dbg(1, "stats: %s: %s: calls=%lu errors=%lu cached=%lu coalesced=%lu rows=%lu bytes=%lu\n",
+			s->role, s->query ? s->query : "(role)", s->calls, s->errors, s->cached, s->coalesced,
+			s->rows, s->bytes);
+
+		for (i = 0; i < ST_MAX; i++) {
+			h = &s->stages[i];
+			if (h->count == 0)
+				continue;
+
+			dbg(1, "stats:   %-8s n=%lu p50=%luus p99=%luus p999=%luus max=%luus\n", stages[i],
+				h->count, hist_pct(h, 0.50), hist_pct(h, 0.99), hist_pct(h, 0.999), h->max);
+		}
+	}
+
+	pthread_mutex_unlock(&stats.lock);
+}
+
+/****************************************************/
+/******************* Random IDs *********************/
+/****************************************************/
+
+/* kernel randomness, fetched in chunks */
+static __thread unsigned char rnd_pool[256];
+static __thread int rnd_left;
+
+static bool rnd_fill(void)
+{
+	ssize_t n = -1;
+	int fd;
+
+#ifdef SYS_getrandom
+	n = syscall(SYS_getrandom, rnd_pool, sizeof rnd_pool, 0);
+#endif
+
+	/* old kernel */
+	if (n != sizeof rnd_pool) {
+		fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return false;
+
+		n = read(fd, rnd_pool, sizeof rnd_pool);
+		close(fd);
+
+		if (n != sizeof rnd_pool)
+			return false;
+	}
+
+	rnd_left = sizeof rnd_pool;
 	return true;
 }
 
-MYSQL_RES *query_res(MYSQL *conn, const char *query)
+char *random_hex(int bytes, void *mm)
 {
-	asnsert(conn);
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c;
+	char *ret;
+	int i;
+
+	ret = mmatic_alloc(bytes * 2 + 1, mm);
 
-	if (mysql_query(conn, query) != 0)
-		die("query '%s' failed: %s", query, mysql_error(conn));
+	for (i = 0; i < bytes; i++) {
+		if (rnd_left == 0 && !rnd_fill()) {
+			dbg(0, "reading random bytes failed: %s\n", strerror(errno));
+			mmatic_freeptr(ret);
+			return NULL;
+		}
+
+		/* never hand out the same bytes twice */
+		c = rnd_pool[--rnd_left];
+		rnd_pool[rnd_left] = 0;
+
+		ret[2*i]   = hex[c >> 4];
+		ret[2*i+1] = hex[c & 0x0f];
+	}
 
-	return mysql_store_result(conn);
+	ret[bytes * 2] = '\0';
+	return ret;
 }
 
-char *escape(MYSQL *conn, xstr *arg)
+/****************************************************/
+/***************** Session cache ********************/
+/****************************************************/
+
+/* protects sqler/sessions in dir private data */
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static time_t sessions_flushed, sessions_written;
+static int sessions_new;
+
+/** Drop expired sessions from the cache
+ * @note call with sessions_lock held */
+static void session_purge(ut *sessions, time_t now)
 {
-	char *buf;
+	thash *h;
+	tlist *old;
+	const char *id;
+	ut *s;
 
-	buf = mmatic_alloc(xstr_length(arg) * 2 + 1, arg);
-	mysql_real_escape_string(conn, buf, xstr_string(arg), xstr_length(arg));
+	h = ut_thash(sessions);
+	old = tlist_create(NULL, sessions);
 
-	return buf;
+	THASH_ITER_LOOP(h, id, s) {
+		if (now - uth_int(s, "timestamp") > SQLER_SESSION_TIMEOUT)
+			tlist_push(old, id);
+	}
+
+	TLIST_ITER_LOOP(old, id)
+		thash_set(h, id, NULL);
+
+	tlist_free(old);
+}
+
+bool session_add(ut *dirprv, const char *id, const char *login, const char *role, bool isnew)
+{
+	ut *sessions, *s;
+	time_t now = time(NULL);
+	int max;
+	bool ret = false;
+
+	max = uth_int(dirprv, "session-cache");
+
+	pthread_mutex_lock(&sessions_lock);
+	sessions = uth_path_create(dirprv, "sessions");
+
+	if (thash_count(ut_thash(sessions)) >= max) {
+		session_purge(sessions, now);
+		if (thash_count(ut_thash(sessions)) >= max) {
+			dbg(3, "session cache full, not caching %s\n", id);
+			goto end;
+		}
+	}
+
+	s = uth_path_create(sessions, id);
+	uth_set_char(s, "login", login);
+	uth_set_char(s, "role", role);
+	uth_set_int(s, "timestamp", now);
+	uth_set_bool(s, "dirty", false);
+	uth_set_bool(s, "new", isnew);
+	if (isnew)
+		sessions_new++;
+	ret = true;
+
+end:
+	pthread_mutex_unlock(&sessions_lock);
+	return ret;
+}
+
+bool session_get(ut *dirprv, const char *id, const char **login, const char **role, void *mm)
+{
+	ut *sessions, *s;
+	time_t now = time(NULL);
+	bool ret = false;
+
+	pthread_mutex_lock(&sessions_lock);
+	sessions = uth_path_create(dirprv, "sessions");
+
+	s = uth_get(sessions, id);
+	if (!s)
+		goto end;
+
+	if (now - uth_int(s, "timestamp") > SQLER_SESSION_TIMEOUT) {
+		thash_set(ut_thash(sessions), id, NULL);
+		goto end;
+	}
+
+	/* will be written back in session_flush() */
+	uth_set_int(s, "timestamp", now);
+	uth_set_bool(s, "dirty", true);
+
+	*login = mmatic_strdup(uth_char(s, "login"), mm);
+	*role = mmatic_strdup(uth_char(s, "role"), mm);
+	ret = true;
+
+end:
+	pthread_mutex_unlock(&sessions_lock);
+	return ret;
+}
+
+/** Remember time of write by session, see conn_route() */
+static void session_wrote(ut *dirprv, const char *id)
+{
+	ut *s;
+
+	if (uth_int(dirprv, "sticky") <= 0)
+		return;
+
+	pthread_mutex_lock(&sessions_lock);
+	s = uthp_get(dirprv, "sessions", id);
+	if (s)
+		uth_set_int(s, "written", time(NULL));
+	pthread_mutex_unlock(&sessions_lock);
+}
+
+/** Check if session wrote recently, so its reads must go to the primary
+ * @note sessions not in the cache are never sticky */
+static bool session_sticky(ut *dirprv, const char *id)
+{
+	ut *s;
+	int sticky;
+	bool ret = false;
+
+	sticky = uth_int(dirprv, "sticky");
+	if (sticky <= 0)
+		return false;
+
+	pthread_mutex_lock(&sessions_lock);
+	s = uthp_get(dirprv, "sessions", id);
+	if (s && uth_get(s, "written"))
+		ret = (time(NULL) - uth_int(s, "written") < sticky);
+	pthread_mutex_unlock(&sessions_lock);
+
+	return ret;
+}
+
+/** Escape string for session_flush() */
+static char *session_esc(MYSQL *conn, const char *str, void *mm)
+{
+	size_t len = strlen(str);
+	char *ret;
+
+	ret = mmatic_alloc(len * 2 + 1, mm);
+	mysql_real_escape_string(conn, ret, str, len);
+	return ret;
+}
+
+/** Check if session_flush() has anything to write now
+ * @note call with sessions_lock held */
+static bool session_due(time_t now)
+{
+	return now - sessions_flushed >= SQLER_SESSION_FLUSH ||
+		(sessions_new > 0 && now - sessions_written >= SQLER_SESSION_WRITE);
+}
+
+bool session_flush_due(void)
+{
+	bool ret;
+
+	pthread_mutex_lock(&sessions_lock);
+	ret = session_due(time(NULL));
+	pthread_mutex_unlock(&sessions_lock);
+
+	return ret;
+}
+
+/** Mark sessions as not written after failed session_flush()
+ * @param flag        "new" or "dirty" */
+static void session_unflush(ut *dirprv, tlist *list, const char *flag)
+{
+	ut *sessions, *s;
+	const char *id;
+
+	pthread_mutex_lock(&sessions_lock);
+	sessions = uth_path_create(dirprv, "sessions");
+
+	TLIST_ITER_LOOP(list, id) {
+		/* may be purged meanwhile */
+		s = uth_get(sessions, id);
+		if (!s || uth_bool(s, flag))
+			continue;
+
+		uth_set_bool(s, flag, true);
+		if (streq(flag, "new"))
+			sessions_new++;
+	}
+
+	pthread_mutex_unlock(&sessions_lock);
+}
+
+bool session_flush(ut *dirprv, MYSQL *conn, bool force)
+{
+	mmatic *mm;
+	ut *sessions, *s;
+	thash *h;
+	tlist *added, *touched;
+	const char *id;
+	xstr *ids, *rows;
+	time_t now = time(NULL);
+	bool due, ret = true;
+
+	pthread_mutex_lock(&sessions_lock);
+
+	if (!force && !session_due(now)) {
+		pthread_mutex_unlock(&sessions_lock);
+		return true;
+	}
+
+	due = force || now - sessions_flushed >= SQLER_SESSION_FLUSH;
+	sessions_written = now;
+	if (due)
+		sessions_flushed = now;
+
+	mm = mmatic_create();
+	ids = xstr_create("", mm);
+	rows = xstr_create("", mm);
+	added = tlist_create(NULL, mm);
+	touched = tlist_create(NULL, mm);
+
+	sessions = uth_path_create(dirprv, "sessions");
+	if (due)
+		session_purge(sessions, now);
+
+	/* session IDs are guaranteed to be alphanumeric by common_fw */
+	h = ut_thash(sessions);
+	THASH_ITER_LOOP(h, id, s) {
+		if (uth_bool(s, "new")) {
+			if (xstr_length(rows) > 0)
+				xstr_append_char(rows, ',');
+			xstr_append(rows, mmatic_printf(mm, "('%s','%s','%s',%d)", id,
+				session_esc(conn, uth_char(s, "login"), mm),
+				session_esc(conn, uth_char(s, "role"), mm),
+				uth_int(s, "timestamp")));
+
+			tlist_push(added, mmatic_strdup(id, mm));
+			uth_set_bool(s, "new", false);
+			uth_set_bool(s, "dirty", false);
+		} else if (due && uth_bool(s, "dirty")) {
+			if (xstr_length(ids) > 0)
+				xstr_append_char(ids, ',');
+			xstr_append(ids, mmatic_printf(mm, "'%s'", id));
+
+			tlist_push(touched, mmatic_strdup(id, mm));
+			uth_set_bool(s, "dirty", false);
+		}
+	}
+
+	sessions_new = 0;
+	pthread_mutex_unlock(&sessions_lock);
+
+	/* flags are cleared above so that sessions changed meanwhile are written next time */
+	if (xstr_length(rows) > 0) {
+		dbg(8, "writing new sessions: %s\n", xstr_string(rows));
+		if (!query(conn, mmatic_printf(mm,
+				"REPLACE INTO sessions (id, login, role, timestamp) VALUES %s", xstr_string(rows)))) {
+			dbg(1, "writing %u new sessions failed, will retry\n", tlist_count(added));
+			session_unflush(dirprv, added, "new");
+			ret = false;
+		}
+	}
+
+	if (xstr_length(ids) > 0) {
+		dbg(8, "flushing session timestamps: %s\n", xstr_string(ids));
+		if (!query(conn, mmatic_printf(mm,
+				"UPDATE sessions SET timestamp = UNIX_TIMESTAMP() WHERE id IN (%s)", xstr_string(ids)))) {
+			dbg(1, "flushing %u session timestamps failed, will retry\n", tlist_count(touched));
+			session_unflush(dirprv, touched, "dirty");
+			ret = false;
+		}
+	}
+
+	mmatic_free(mm);
+	return ret;
 }
 
 /****************************************************/
@@ -55,118 +1895,204 @@ char *escape(MYSQL *conn, xstr *arg)
 
 static bool init(struct mod *mod)
 {
+	struct dbpool *pool;
+	struct dbconn *admin;
 	MYSQL *conn;
-	const char *dbhost, *dbname, *rolename;
+	const char *rolename;
 	thash *roles;
-	tlist *scan;
-	ut *dbuser, *role, *dirprv;
+	tlist *pools, *hosts;
+	ut *dbuser, *role, *dirprv, *v;
+	bool ret = false;
+	int i;
 
 	dirprv = uth_path_create(mod->dir->prv, "sqler");
 
+	/* session cache size */
+	uth_set_int(dirprv, "session-cache",
+		uth_get(mod->cfg, "session-cache") ? uth_int(mod->cfg, "session-cache") : SQLER_SESSION_CACHE);
+
+	/* reads of session go to the primary for this long after its write [s] */
+	uth_set_int(dirprv, "sticky", uth_int(mod->cfg, "sticky"));
+
+	/* periodic dump of statistics */
+	stats.interval = uth_int(mod->cfg, "stats-interval");
+	stats.dumped = time(NULL);
+
+	/* needed before connecting from many threads */
+	if (mysql_library_init(0, NULL, NULL) != 0) {
+		dbg(0, "initialization of MySQL client library failed\n");
+		return false;
+	}
+
 	/*
-	 * make connections for each of cfg.roles
+	 * make connection pools for each of cfg.roles
 	 */
-	dbhost = uth_char(mod->cfg, "dbhost");
-	dbname = uth_char(mod->cfg, "dbname");
 	roles = uth_thash(mod->cfg, "roles");
+	pools = tlist_create(NULL, mod);
 
 	THASH_ITER_LOOP(roles, rolename, dbuser) {
-		conn = mysql_init(NULL);
-		if (!conn) {
-			dbg(0, "initialization of MySQL client library failed");
-			return false;
-		}
+		pool = pool_create(mod->cfg, rolename, dbuser, uth_char(mod->cfg, "dbhost"));
+		tlist_push(pools, pool);
 
-		if (!mysql_real_connect(conn, dbhost, uth_char(dbuser, "user"), uth_char(dbuser, "pass"), dbname, 0, NULL, 0)) {
-			dbg(0, "role %s: database connection failed: %s\n", rolename, mysql_error(conn));
-			return false;
+		/* replicas for reads, role list overrides global one; connected on demand */
+		hosts = uth_get(dbuser, "replicas") ? uth_tlist(dbuser, "replicas") : uth_tlist(mod->cfg, "replicas");
+		if (hosts && tlist_count(hosts) > 0) {
+			pool->replicas = mmatic_alloc(sizeof(struct dbpool *) * tlist_count(hosts), pool->mm);
+			i = 0;
+			TLIST_ITER_LOOP(hosts, v) {
+				pool->replicas[i] = pool_create(mod->cfg, rolename, dbuser, ut_char(v));
+				pool->replicas[i]->min = 0;
+				i++;
+			}
+			pool->nreplicas = i;
 		}
 
-		query(conn, "SET NAMES 'binary'");
-
-		dbg(8, "role %s: connected to database\n", rolename);
 		role = uth_path_create(dirprv, "roles", rolename);
-		uth_set_ptr(role, "conn", conn);
+		uth_set_ptr(role, "pool", pool);
+		uth_set_ptr(role, "stats", stats_get(rolename, NULL));
 	}
 
+	if (!pool_fill(pools))
+		return false;
+
 	/*
 	 * prepare database
 	 */
-	conn = uthp_ptr(dirprv, "roles", "admin", "conn");
-	if (!conn) {
+	pool = uthp_ptr(dirprv, "roles", "admin", "pool");
+	if (!pool) {
 		dbg(0, "missing MySQL connection for 'admin' role\n");
 		return false;
 	}
 
+	admin = pool_get(pool);
+	if (!admin)
+		return false;
+	conn = admin->mysql;
+
 	/* create table users -- if not exists */
 	if (!query(conn, SQLER_USERS_TABLE))
-		return false;
+		goto end;
 
 	/* create table sessions -- if not exists */
 	if (!query(conn, SQLER_SESSIONS_TABLE))
-		return false;
+		goto end;
 
 	/* drop old sessions */
-	if (!query(conn, "DELETE FROM sessions WHERE timestamp < UNIX_TIMESTAMP() - " SQLER_SESSION_TIMEOUT))
-		return false;
+	if (!query(conn, mmatic_printf(mod,
+			"DELETE FROM sessions WHERE timestamp < UNIX_TIMESTAMP() - %d", SQLER_SESSION_TIMEOUT)))
+		goto end;
 
-	return true;
+	ret = true;
+
+end:
+	pool_put(admin);
+	return ret;
 }
 
 static bool handle(struct req *req)
 {
 	const char *session, *role, *login;
+	char *sql, *msg;
 	ut *dirprv, *reqprv;
-	thash *queries;
+	struct dbpool *admin;
+	struct dbconn *dbconn = NULL;
+	struct stats *st;
 	MYSQL *conn;
 	MYSQL_RES *res;
 	MYSQL_ROW row;
+	uint64_t start;
+	bool cached;
 
 	/* skip for "login" */
 	if (streq(req->method, "login"))
 		return true;
 
+	start = stats_clock();
+	stats_dump();
+
 	dirprv = uth_path_create(req->mod->dir->prv, "sqler");
 	reqprv = uth_path_create(req->prv, "sqler");
-	conn = uthp_ptr(dirprv, "roles", "admin", "conn");
-	asnsert(dirprv && reqprv && conn);
+	admin = uthp_ptr(dirprv, "roles", "admin", "pool");
+	asnsert(dirprv && reqprv && admin);
 
 	/* session is required for all other methods */
 	session = uth_char(req->params, "session");
 	if (!session)
 		return err(-ENOSESS, "Session ID required", NULL);
 
-	/* get session login and role */
-	res = query_res(conn, pb(
-		"SELECT login, role FROM sessions \
-		WHERE id='%s' AND timestamp >= UNIX_TIMESTAMP() - " SQLER_SESSION_TIMEOUT " LIMIT 1",
-		session));
+	/* get session login and role - try the cache first */
+	cached = session_get(dirprv, session, &login, &role, req);
+
+	/* admin connection only for session lookup and write-back */
+	if (!cached || session_flush_due()) {
+		dbconn = pool_get(admin);
+		if (!dbconn)
+			return err(-ECONN, "DB connection not available", "admin");
+		conn = dbconn->mysql;
+	}
+
+	if (!cached) {
+		sql = pb("SELECT login, role FROM sessions \
+			WHERE id='%s' AND timestamp >= UNIX_TIMESTAMP() - %d LIMIT 1",
+			session, SQLER_SESSION_TIMEOUT);
+		res = query_res(conn, sql);
+
+		/* connection lost - the read is safe to repeat on a fresh one */
+		if (!res && conn_lost(mysql_errno(conn))) {
+			pool_put(dbconn);
+
+			dbconn = pool_get(admin);
+			if (!dbconn)
+				return err(-ECONN, "DB connection not available", "admin");
+			conn = dbconn->mysql;
+
+			res = query_res(conn, sql);
+		}
+
+		if (!res) {
+			msg = pb("MySQL errno %u: %s", mysql_errno(conn), mysql_error(conn));
+			pool_put(dbconn);
+			return err(-EQUERY, "Session lookup failed", msg);
+		}
+
+		if (!(row = mysql_fetch_row(res))) {
+			mysql_free_result(res);
+			pool_put(dbconn);
+			return err(-ESESS, "Session not found", session);
+		}
 
-	if (!(row = mysql_fetch_row(res))) {
+		login = mmatic_strdup(row[0], req);
+		role = mmatic_strdup(row[1], req);
 		mysql_free_result(res);
-		return err(-ESESS, "Session not found", session);
+
+		/* update session */
+		query(conn, pb("UPDATE sessions SET timestamp = UNIX_TIMESTAMP() WHERE id='%s'", session));
+		session_add(dirprv, session, login, role, false);
 	}
 
-	login = mmatic_strdup(row[0], req);
-	role = mmatic_strdup(row[1], req);
-	mysql_free_result(res);
+	/* write back timestamps of cached sessions, if its time */
+	if (dbconn) {
+		session_flush(dirprv, conn, false);
+		pool_put(dbconn);
+	}
 
-	/* update session */
-	query(conn, pb("UPDATE sessions SET timestamp = UNIX_TIMESTAMP() WHERE id='%s'", session));
+	st = uthp_ptr(dirprv, "roles", role, "stats");
+	if (st)
+		stats_time(st, ST_SESSION, stats_clock() - start);
 
 	/* copy to req data */
 	uth_set_char(reqprv, "role", role);
 	uth_set_char(reqprv, "login", login);
 
-	uth_set_ptr(reqprv, "conn", uthp_ptr(dirprv, "roles", role, "conn"));
+	/* connection is checked out on first use, see conn_get() */
+	uth_set_ptr(reqprv, "pool", uthp_ptr(dirprv, "roles", role, "pool"));
 
-	queries = uthp_thash(dirprv, "roles", role, "queries");
-	if (queries)
-		uth_set_thash(reqprv, "queries", queries);
-
-	if (!uth_get(reqprv, "conn"))
+	if (!uth_ptr(reqprv, "pool"))
 		return err(-ECONN, "DB connection not found for given role", role);
 
+	/* modules reading the whitelist pin it, see qtable_pin() */
+	uth_set_ptr(reqprv, "qslot", uthp_ptr(dirprv, "roles", role, "queries"));
+
 	return true;
 }
 
@@ -8,9 +8,16 @@
 #ifndef _COMMON_H_
 #define _COMMON_H_
 
+#include <stdint.h>
+#include <pthread.h>
 #include <libpjf/lib.h>
 #include <mysql/mysql.h>
 
+/* MySQL 8.0 client library has bool in MYSQL_BIND and no my_bool */
+#if MYSQL_VERSION_ID >= 80001 && !defined(MARIADB_BASE_VERSION)
+typedef bool my_bool;
+#endif
+
 #define SQLER_DEFAULT_EXT "js"
 #define SQLER_TAG "sqler:"
 
@@ -30,7 +37,76 @@
 	"  timestamp int(10) unsigned NOT NULL default '0',"  \
 	"  PRIMARY KEY (id))"
 
-#define SQLER_SESSION_TIMEOUT "3600"
+/** Session lifetime since last request [s] */
+#define SQLER_SESSION_TIMEOUT 3600
+
+/** Default max. number of sessions kept in memory */
+#define SQLER_SESSION_CACHE 10000
+
+/** How often to write session timestamps back to the database [s] */
+#define SQLER_SESSION_FLUSH 60
+
+/** How often to write new sessions to the database [s] */
+#define SQLER_SESSION_WRITE 1
+
+/** Number of random bytes in session ID */
+#define SQLER_SESSION_IDLEN 16
+
+/** Default connection pool limits, per role */
+#define SQLER_POOL_MIN 1
+#define SQLER_POOL_MAX 8
+
+/** Max. time to wait for a free connection in an exhausted pool [s] */
+#define SQLER_POOL_WAIT 10
+
+/** Max. delay between attempts to connect to unreachable database [s] */
+#define SQLER_RECONNECT_MAX 30
+
+/** Idle time after which a connection is checked before use [s] */
+#define SQLER_PING_IDLE 10
+
+/** Time to skip a replica after failing to connect to it [s] */
+#define SQLER_REPLICA_RETRY 10
+
+/** Max. number of connections used concurrently by a single request */
+#define SQLER_ASYNC_CONNS 4
+
+/** Default max. number of cached query results */
+#define SQLER_CACHE_SIZE 1000
+
+/** Max. number of rows in a cached query result */
+#define SQLER_CACHE_ROWS 10000
+
+/** Max. time to wait for identical query being executed, if it has no timeout [ms] */
+#define SQLER_FLIGHT_WAIT 5000
+
+/** Default max. number of open cursors */
+#define SQLER_CURSOR_MAX 16
+
+/** Default time after which an idle cursor is closed [s] */
+#define SQLER_CURSOR_TIMEOUT 60
+
+/** Default max. rows and size of rows [B] in one INSERT of bulk mode */
+#define SQLER_BULK_ROWS 1000
+#define SQLER_BULK_BYTES (1024 * 1024)
+
+/** Max. number of threads scanning sources at startup */
+#define SQLER_SCAN_THREADS 16
+
+/** Time to wait for more source changes before reloading queries [ms] */
+#define SQLER_RELOAD_DELAY 200
+
+/** Size of memory chunks of request arena */
+#define SQLER_ARENA_CHUNK 16384
+
+/** Max. number of per-query statistics entries */
+#define SQLER_STATS_MAX 10000
+
+/** Histogram precision: sub-buckets per power of two */
+#define HIST_SUB 4
+
+/** Histogram range: 1us .. 2^32us */
+#define HIST_BUCKETS (32 * HIST_SUB)
 
 /** Errors */
 #define ESESS 1
@@ -43,6 +119,120 @@
 #define EEMAILNOSTATUS 8
 #define EEMAILSTATUS 9
 #define EEMAILLIMIT 10
+#define EARGS 11
+#define ECURSOR 12
+#define EEMAILQUEUE 13
+#define ETIMEOUT 14
+
+/****************************************************/
+/***************** Connection pool ******************/
+/****************************************************/
+
+struct dbpool;
+
+/** Pooled database connection */
+struct dbconn {
+	mmatic *mm;                   /** memory for connection data */
+	MYSQL *mysql;                 /** MySQL connection handle */
+	struct dbpool *pool;          /** pool it belongs to */
+	thash *stmts;                 /** prepared statements: SQL text -> MYSQL_STMT */
+	time_t used;                  /** time of last return to the pool */
+};
+
+/** Database connections of a single role */
+struct dbpool {
+	mmatic *mm;                   /** memory for pool and its connections */
+	const char *role;             /** role name */
+	const char *host, *db;        /** database host and name */
+	const char *user, *pass;      /** database credentials */
+
+	int min, max;                 /** pool size limits */
+	int size;                     /** number of open connections */
+	tlist *idle;                  /** connections ready for checkout */
+	int busy;                     /** number of checked out connections */
+	int fails;                    /** failed connection attempts in a row */
+	time_t down;                  /** time of last failed connection attempt */
+	int timeout;                  /** default query timeout [ms], 0 if none */
+	int cursors;                  /** connections reserved by cursors, under query.c cursors.lock */
+	MYSQL *killer;                /** side connection for KILL QUERY, used by watchdog only */
+
+	struct dbpool **replicas;     /** pools of read-only replicas */
+	int nreplicas;                /** number of replicas */
+
+	pthread_mutex_t lock;         /** protects size and idle */
+	pthread_cond_t cond;          /** signaled on connection return */
+};
+
+/** Query whitelist of a role */
+struct qtable {
+	mmatic *mm;                   /** memory of this table */
+	thash *queries;               /** normalized query -> struct query */
+	int refs;                     /** requests using it, plus one while published; atomic */
+	void (*release)(struct qtable *t); /** frees the table once refs drop to 0 */
+};
+
+/** Where query module publishes struct qtable of a role
+ * Replaced as a whole on reload with qtable_publish(), pinned by readers
+ * with qtable_get(); neither takes a lock. */
+struct qslot {
+	struct qtable *cur;           /** current table; atomic */
+	int epoch;                    /** index of readers[] for new readers; atomic */
+	int readers[2];               /** readers between loading cur and pinning it; atomic */
+};
+
+/** Measured stages of request handling */
+enum stage { ST_SESSION, ST_FILL, ST_QUERY, ST_FETCH, ST_REPLY, ST_MAX };
+
+/** Latency histogram with log-linear buckets, updated with atomic operations */
+struct hist {
+	unsigned long count;          /** number of samples */
+	unsigned long sum;            /** sum of samples [us] */
+	unsigned long max;            /** largest sample [us] */
+	unsigned long buckets[HIST_BUCKETS];
+};
+
+/** Statistics of a query executed by a role, see stats_get() */
+struct stats {
+	const char *role;             /** role */
+	const char *query;            /** normalized query, NULL for role-wide stats */
+	unsigned long calls;          /** number of executions */
+	unsigned long errors;         /** number of failed executions */
+	unsigned long cached;         /** number of answers from result cache */
+	unsigned long coalesced;      /** number of answers shared from identical running query */
+	unsigned long rows;           /** rows returned */
+	unsigned long bytes;          /** bytes of values returned */
+	struct hist stages[ST_MAX];   /** time spent in each stage */
+};
+
+/** Per-thread buffer reused between requests, see tbuf_get() */
+struct tbuf {
+	char *buf;                    /** memory, outlives requests */
+	size_t size;                  /** allocated size */
+};
+
+/** Query executed through the non-blocking API, see async_run() */
+struct aquery {
+	struct dbconn *conn;          /** connection to execute on */
+	const char *sql;              /** query to execute */
+
+	MYSQL_RES *res;               /** result set, NULL if none */
+	my_ulonglong insert_id;       /** if no result set: last insert ID */
+	my_ulonglong affected;        /** if no result set: number of affected rows */
+	unsigned int errcode;         /** MySQL error number, 0 on success */
+	const char *error;            /** MySQL error message */
+
+	int stage;                    /** execution stage, internal */
+	int status;                   /** events waited for, internal */
+	int rc;                       /** return code of query, internal */
+};
+
+/** Deadline of a running query, see deadline_start() */
+struct deadline {
+	struct dbpool *pool;          /** pool of connection running the query */
+	unsigned long thread;         /** its MySQL thread ID */
+	uint64_t at;                  /** expiry time, see stats_clock() */
+	int state;                    /** internal */
+};
 
 /****************************************************/
 /**************** Library functions *****************/
@@ -52,16 +242,195 @@
 bool _sqlerr(int code, const char *msg, struct req *req, const char *filename, unsigned int linenum);
 #define sqlerr(code, msg) _sqlerr(code, msg, req, __FILE__, __LINE__)
 
-/** Make a MySQL query, die if it fails and do not return any data */
+/** Make a MySQL query and do not return any data
+ * @retval false      query failed, see mysql_error() */
 bool query(MYSQL *conn, const char *query);
 
-/** Make a MySQL query, die if it fails and do return mysql res
- * @note remember about mysql_free_result() */
+/** Make a MySQL query and return mysql res
+ * @note remember about mysql_free_result()
+ * @retval NULL       query failed, see mysql_error() */
 MYSQL_RES *query_res(MYSQL *conn, const char *query);
 
+/** Check if MySQL error code means the connection is broken */
+bool conn_lost(unsigned int code);
+
 /** Escape given string using mysql_real_escape_string() */
 char *escape(MYSQL *conn, xstr *arg);
 
+/** Normalize query as sent by client: skip SQLER_TAG, squeeze white space */
+char *get_query(struct req *req, const char *orig_query);
+
+/** Compiled query, private to query module */
+struct query;
+
+/** Normalize query and check it against role whitelist, see qtable_pin()
+ * @param query       normalized query
+ * @param q           compiled query, NULL if role has no whitelist
+ * @retval false      access denied, error set in reply */
+bool check_query(struct req *req, const char *orig_query, char **query, struct query **q);
+
+/** Drop tabs and newlines, collapse runs of spaces into one
+ * @param dst         output buffer, at least len + 1 bytes
+ * @return            length of output, without the terminating NUL */
+size_t text_squeeze(char *dst, const char *src, size_t len);
+
+/** Length of text_crlf() output, without the terminating NUL */
+size_t text_crlf_len(const char *src, size_t len);
+
+/** Convert LF line endings to CRLF, keeping existing CRLFs
+ * @param dst         output buffer, at least text_crlf_len() + 1 bytes
+ * @return            length of output, without the terminating NUL */
+size_t text_crlf(char *dst, const char *src, size_t len);
+
+/** Escape string for use between double quotes in JSON
+ * @param dst         output buffer, at least 6 * len + 1 bytes
+ * @return            length of output, without the terminating NUL */
+size_t text_json(char *dst, const char *src, size_t len);
+
+/** Allocate memory freed along with the request
+ * Small allocations are carved from SQLER_ARENA_CHUNK bytes large chunks.
+ * @note memory is not zeroed, but aligned to 16 bytes */
+void *arena_alloc(struct req *req, size_t size);
+
+/** Get buffer of at least given size
+ * Grows as needed and never shrinks, contents are not preserved. Meant for
+ * static __thread variables, for data not needed after current call. */
+char *tbuf_get(struct tbuf *b, size_t size);
+
+/** Check out a connection from given pool
+ * Opens a new connection if none is idle and the pool may grow, otherwise
+ * waits up to SQLER_POOL_WAIT seconds for one to be returned. Connections
+ * idle for SQLER_PING_IDLE seconds are pinged and replaced if broken; after
+ * failed attempts to connect, next ones are delayed up to SQLER_RECONNECT_MAX.
+ * @retval NULL       connection failed or pool exhausted */
+struct dbconn *pool_get(struct dbpool *pool);
+
+/** Check out a connection from given pool, but do not wait if none is available
+ * @retval NULL       pool exhausted or connection failed */
+struct dbconn *pool_tryget(struct dbpool *pool);
+
+/** Return connection to its pool, or close it if the connection was lost */
+void pool_put(struct dbconn *conn);
+
+/** Close connection instead of returning it to its pool
+ * Use when connection state is unknown, e.g. after a killed query. */
+void pool_drop(struct dbconn *conn);
+
+/** Get database connection of current request
+ * Checks out a connection from the pool stored in req->prv on first use.
+ * @retval NULL       no connection available */
+MYSQL *conn_get(struct req *req);
+
+/** Get database connection of current request, for a read or a write
+ * Reads go to the least loaded replica of the role, unless the session wrote
+ * in the last "sticky" seconds, or the request already uses the primary.
+ * Writes switch the request to the primary.
+ * @retval NULL       no connection available */
+MYSQL *conn_route(struct req *req, bool read);
+
+/** Return connection of current request to its pool, if checked out */
+void conn_put(struct req *req);
+
+/** Close connection of current request, see pool_drop() */
+void conn_drop(struct req *req);
+
+/** Pin current query table of slot
+ * @note release with qtable_unref()
+ * @retval NULL       nothing published yet */
+struct qtable *qtable_get(struct qslot *slot);
+
+/** Replace query table of slot, release the old one once no reader can pin it
+ * @note one publisher per slot at a time */
+void qtable_publish(struct qslot *slot, struct qtable *t);
+
+/** Release query table, free it if it was the last user */
+void qtable_unref(struct qtable *t);
+
+/** Pin query table of request role and put its queries in req->prv
+ * The table may be replaced any time, but stays valid until qtable_put().
+ * Call in module handle() before reading "queries", and qtable_put() at its end. */
+void qtable_pin(struct req *req);
+
+/** Release query table pinned for current request, if any */
+void qtable_put(struct req *req);
+
+/** Take connection of current request out of request scope
+ * @note the caller must pool_put() it later
+ * @retval NULL       no connection checked out */
+struct dbconn *conn_detach(struct req *req);
+
+/** Get prepared statement for given SQL on connection of current request
+ * Statements are prepared once per connection and cached.
+ * @retval NULL       no connection or statement could not be prepared */
+MYSQL_STMT *stmt_get(struct req *req, const char *sql);
+
+/** Execute queries concurrently, overlapping them on one thread
+ * Queries on the same connection are executed in given order. Uses the
+ * non-blocking client API of MariaDB if available, otherwise runs the
+ * queries one by one.
+ * @param mm          memory for error messages */
+void async_run(struct aquery **queries, int num, void *mm);
+
+/** Kill query running on given connection if it does not finish in time
+ * A watchdog thread issues KILL QUERY through a side connection of the pool.
+ * Every deadline_start() must be followed by deadline_stop().
+ * @param ms          timeout [ms], no deadline if <= 0 */
+void deadline_start(struct deadline *d, struct dbconn *conn, int ms);
+
+/** Cancel deadline, waiting for a kill in progress to finish
+ * @retval true       query was killed, connection should be dropped */
+bool deadline_stop(struct deadline *d);
+
+/** Make random hex string using per-thread buffer of kernel randomness
+ * @param bytes       number of random bytes, string is twice as long
+ * @retval NULL       no randomness available */
+char *random_hex(int bytes, void *mm);
+
+/** Current time for stats_time() [ns] */
+uint64_t stats_clock(void);
+
+/** Find or create statistics entry
+ * @param query       normalized query, NULL for role-wide statistics
+ * @note entries are never freed */
+struct stats *stats_get(const char *role, const char *query);
+
+/** Record time spent in given stage
+ * @param ns          duration, see stats_clock() */
+void stats_time(struct stats *s, enum stage st, uint64_t ns);
+
+/** Add counter value, without locking */
+#define stats_add(s, counter, val) __atomic_fetch_add(&(s)->counter, (val), __ATOMIC_RELAXED)
+
+/** Put statistics of all queries and of memory allocations in reply
+ * @param reset       zero all counters afterwards */
+void stats_reply(ut *reply, bool reset);
+
+/** Write statistics to log every "stats-interval" seconds */
+void stats_dump(void);
+
+/** Put session into in-memory session cache
+ * @param dirprv      sqler private dir data
+ * @param isnew       session not in database yet, session_flush() will insert it
+ * @retval false      cache full */
+bool session_add(ut *dirprv, const char *id, const char *login, const char *role, bool isnew);
+
+/** Find session in in-memory cache and refresh its timestamp
+ * @param login       destination for login, allocated in mm
+ * @param role        destination for role, allocated in mm
+ * @retval false      session not cached or expired */
+bool session_get(ut *dirprv, const char *id, const char **login, const char **role, void *mm);
+
+/** Write new sessions and refreshed session timestamps back to the database
+ * New sessions are written every SQLER_SESSION_WRITE seconds, timestamps
+ * every SQLER_SESSION_FLUSH seconds. Sessions that failed to be written are
+ * tried again on next write.
+ * @param force       write everything now
+ * @retval false      writing failed */
+bool session_flush(ut *dirprv, MYSQL *conn, bool force);
+
+/** Check if session_flush() would write anything now */
+bool session_flush_due(void);
+
 #define pb(...) mmatic_printf(req, __VA_ARGS__)
 
 #endif
@@ -5,6 +5,9 @@
  * Licensed under GPLv3
  */
 
+#include <time.h>
+#include <regex.h>
+#include <pthread.h>
 #include <rpcd/rpcd_module.h>
 #include <libesmtp.h>
 #include <auth-client.h>
@@ -12,23 +15,97 @@
 
 #define pb(...) mmatic_printf(req, __VA_ARGS__)
 
-static bool smtperr(int code, char *msg, struct req *req)
-{
-	char buf[128];
+/** Max. number of messages waiting for delivery */
+#define SQLER_MAIL_QUEUE 10000
 
-	return err(code, msg, smtp_strerror(smtp_errno(), buf, sizeof buf));
-}
+/** Max. number of messages sent in one SMTP session */
+#define SQLER_MAIL_BATCH 100
+
+/** How long delivery status is kept after delivery [s] */
+#define SQLER_MAIL_KEEP 3600
+
+/** Max. number of recipients of bulk message */
+#define SQLER_MAIL_RCPTS 10000
+
+/** Max. number of recipients in one SMTP transaction (RFC 5321 minimum) */
+#define SQLER_MAIL_TXRCPTS 100
+
+/** Valid email address, for email_fw and recipient lists */
+#define SQLER_MAIL_ADDR "[^ ]+@[^ ]+\\.[a-z]+$"
+
+/** Length of random part of message ID [B] */
+#define SQLER_MAIL_IDLEN 16
+
+enum mstate { MAIL_QUEUED, MAIL_SENT, MAIL_FAILED };
+
+static const char *mstates[] = { "queued", "sent", "failed" };
+
+/** Recipient of message */
+struct rcpt {
+	char *addr;                  /** email address */
+	smtp_recipient_t handle;     /** libesmtp recipient, during delivery */
+
+	enum mstate state;           /** delivery state */
+	int code;                    /** SMTP status code, or sqler error code */
+	char *status;                /** SMTP status text, or error message */
+};
+
+/** Part of message sent in one SMTP transaction */
+struct part {
+	struct mail *m;              /** message */
+	smtp_message_t message;      /** libesmtp message, during delivery */
+	int first, last;             /** range of recipients */
+	int rstate;                  /** state of readmsg_cb() */
+};
+
+/** Message in outbound queue */
+struct mail {
+	mmatic *mm;                  /** memory of this message */
+	char *id;                    /** message ID */
+	char *login;                 /** login of session that sent it */
+	char *from, *from_name;      /** sender */
+	char *to_name;               /** name of recipient, if just one */
+	struct rcpt *rcpts;          /** recipients */
+	int nrcpts;                  /** number of recipients */
+	struct part *parts;          /** SMTP transactions */
+	int nparts;                  /** number of transactions */
+	char *subject;               /** subject, may be NULL */
+	char *body;                  /** body, with CRLF line endings */
+	int bodylen;                 /** length of body */
+
+	enum mstate state;           /** delivery state */
+	int code;                    /** SMTP status code, or sqler error code */
+	char *status;                /** SMTP status text, or error message */
+	time_t done;                 /** time of delivery attempt */
+};
+
+/** Outbound queue, drained by outbox_worker() */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	mmatic *mm;
+	tlist *queue;                /** messages waiting for delivery */
+	tlist *done;                 /** delivered messages, oldest first */
+	thash *mails;                /** id -> struct mail */
+
+	char *server;                /** SMTP server host:port */
+	const char *user, *password; /** SMTP auth, may be NULL */
+	auth_context_t authctx;      /** shared by all sessions */
+	regex_t addr;                /** SQLER_MAIL_ADDR */
+} outbox = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
 
 static int auth_cb(auth_client_request_t request, char **result, int fields, void *arg)
 {
-	struct req *req = arg;
 	int i;
 
 	for (i = 0; i < fields; i++) {
 		if (request[i].flags & AUTH_USER)
-			result[i] = mmatic_strdup(uth_char(req->mod->cfg, "user"), req);
+			result[i] = (char *) outbox.user;
 		else if (request[i].flags & AUTH_PASS)
-			result[i] = mmatic_strdup(uth_char(req->mod->cfg, "password"), req);
+			result[i] = (char *) outbox.password;
 	}
 
 	return 1;
@@ -36,169 +113,545 @@ static int auth_cb(auth_client_request_t request, char **result, int fields, voi
 
 static const char *readmsg_cb(void **buf, int *len, void *arg)
 {
-	struct req *req = arg;
-	ut *prv;
-	int state, i;
-	const char *p;
-	char last;
-	xstr *ret;
-
-	prv = uth_path_create(req->prv, "sqler");
-
-	if (len) {
-		state = uth_int(prv, "readmsg_cb"); /* defaults to 0 */
-		uth_set_int(prv, "readmsg_cb", state+1);
-
-		switch (state) {
-			case 0:
-				*len = 2;
-				return "\r\n";
-			case 1:
-				ret = xstr_create("", req);
-
-				p = uth_char(req->params, "body");
-				for (i = 0; p[i]; i++) {
-					if (p[i] == '\n' && last != '\r')
-						xstr_append_char(ret, '\r');
-
-					xstr_append_char(ret, p[i]);
-					last = p[i];
-				}
-
-				*len = xstr_length(ret);
-				return xstr_string(ret);
-			default:
-				*len = 0;
-		}
+	struct part *part = arg;
+
+	/* rewind */
+	if (!len) {
+		part->rstate = 0;
+		return NULL;
+	}
+
+	switch (part->rstate++) {
+		case 0:
+			*len = 2;
+			return "\r\n";
+		case 1:
+			*len = part->m->bodylen;
+			return part->m->body;
+		default:
+			*len = 0;
 	}
 
 	return NULL;
 }
 
-static bool sendmail(struct req *req)
+/** Convert LF line endings to CRLF */
+static char *crlf(const char *p, int *len, void *mm)
+{
+	size_t n;
+	char *ret;
+
+	n = strlen(p);
+	ret = mmatic_alloc(text_crlf_len(p, n) + 1, mm);
+	*len = text_crlf(ret, p, n);
+
+	return ret;
+}
+
+/** Forget delivery status of old messages, under outbox.lock */
+static void outbox_purge(void)
+{
+	struct mail *m;
+	time_t now = time(NULL);
+
+	TLIST_ITER_LOOP(outbox.done, m) {
+		/* everything after is newer */
+		if (m->done + SQLER_MAIL_KEEP > now)
+			break;
+
+		tlist_remove(outbox.done);
+		thash_set(outbox.mails, m->id, NULL);
+		mmatic_free(m->mm);
+	}
+}
+
+/** Record outcome of message part */
+static void part_done(struct part *part, bool ok, const char *error)
+{
+	struct mail *m = part->m;
+	struct rcpt *r;
+	const smtp_status_t *status;
+	int i;
+
+	/* no allowed recipients, not sent */
+	if (!part->message)
+		return;
+
+	status = ok ? smtp_message_transfer_status(part->message) : NULL;
+
+	/* message */
+	if (m->state == MAIL_QUEUED || m->state == MAIL_SENT) {
+		if (!ok) {
+			m->state = MAIL_FAILED;
+			m->code = -EEMAILSESS;
+			m->status = mmatic_printf(m->mm, "SMTP session failed: %s", error);
+		} else if (!status) {
+			m->state = MAIL_FAILED;
+			m->code = -EEMAILNOSTATUS;
+			m->status = mmatic_strdup("Could not retrieve SMTP message transfer status", m->mm);
+		} else {
+			m->state = (status->code == 250) ? MAIL_SENT : MAIL_FAILED;
+			m->code = status->code;
+			m->status = mmatic_strdup(status->text ? status->text : "", m->mm);
+		}
+	}
+
+	/* its recipients */
+	for (i = part->first; i < part->last; i++) {
+		r = &m->rcpts[i];
+		if (r->state != MAIL_QUEUED)
+			continue;
+
+		status = (ok && r->handle) ? smtp_recipient_status(r->handle) : NULL;
+		r->state = MAIL_FAILED;
+		r->handle = NULL;
+
+		if (!status) {
+			r->code = m->code;
+			r->status = m->status;
+		} else {
+			r->code = status->code;
+			r->status = mmatic_strdup(status->text ? status->text : "", m->mm);
+			if (status->code == 250 || status->code == 251)
+				r->state = MAIL_SENT;
+		}
+	}
+}
+
+/** Send messages in one SMTP session */
+static void sendmail(struct mail **mails, int num)
 {
 	smtp_session_t session;
 	smtp_message_t message;
-	smtp_recipient_t recipient;
-	auth_context_t authctx;
-	const smtp_status_t *status;
-	const char *host, *port, *subject;
+	struct mail *m;
+	struct part *part;
+	struct rcpt *r;
+	char buf[128];
+	bool ok;
+	int i, j, k;
 
 	session = smtp_create_session();
-	message = smtp_add_message(session);
+	smtp_set_server(session, outbox.server);
 
-	auth_client_init();
-	authctx = auth_create_context();
+	/* SMTP auth */
+	if (outbox.user && outbox.password)
+		smtp_auth_set_context(session, outbox.authctx);
 
-	/* SMTP server */
-	host = uth_char(req->mod->cfg, "host");
-	port = uth_char(req->mod->cfg, "port");
-	smtp_set_server(session, pb("%s:%s", host ? host : "localhost", port ? port : "25"));
+	for (i = 0; i < num; i++) {
+		m = mails[i];
 
-	/* SMTP auth */
-	if (uth_char(req->mod->cfg, "user") && uth_char(req->mod->cfg, "password")) {
-		auth_set_mechanism_flags(authctx, AUTH_PLUGIN_PLAIN, 0);
-		auth_set_interact_cb(authctx, auth_cb, (void *) req);
-		smtp_auth_set_context(session, authctx);
-	}
+		for (j = 0; j < m->nparts; j++) {
+			part = &m->parts[j];
 
-	/* SMTP sender */
-	smtp_set_header(message, "From", uth_char(req->params, "from_name"), uth_char(req->params, "from"));
-	smtp_set_header_option(message, "From", Hdr_OVERRIDE, 1);
-	smtp_set_reverse_path(message, uth_char(req->params, "from"));
+			for (k = part->first; k < part->last; k++) {
+				if (m->rcpts[k].state == MAIL_QUEUED)
+					break;
+			}
+			if (k == part->last)
+				continue;
+
+			message = part->message = smtp_add_message(session);
+
+			/* SMTP sender */
+			smtp_set_header(message, "From", m->from_name, m->from);
+			smtp_set_header_option(message, "From", Hdr_OVERRIDE, 1);
+			smtp_set_reverse_path(message, m->from);
+
+			/* SMTP recipients - bulk messages do not disclose the list */
+			if (m->nrcpts == 1)
+				smtp_set_header(message, "To", m->to_name, m->rcpts[0].addr);
+			else
+				smtp_set_header(message, "To", NULL, "undisclosed-recipients:;");
+			smtp_set_header_option(message, "To", Hdr_OVERRIDE, 1);
+
+			for (k = part->first; k < part->last; k++) {
+				r = &m->rcpts[k];
+				if (r->state == MAIL_QUEUED)
+					r->handle = smtp_add_recipient(message, r->addr);
+			}
 
-	/* SMTP recipient */
-	smtp_set_header(message, "To", uth_char(req->params, "to_name"), uth_char(req->params, "to"));
-	smtp_set_header_option(message, "To", Hdr_OVERRIDE, 1);
-	smtp_add_recipient(message, uth_char(req->params, "to"));
+			/* SMTP subject */
+			if (m->subject) {
+				smtp_set_header(message, "Subject", m->subject);
+				smtp_set_header_option(message, "Subject", Hdr_OVERRIDE, 1);
+			}
 
-	/* SMTP subject */
-	subject = uth_char(req->params, "subject");
-	if (subject) {
-		smtp_set_header(message, "Subject", subject);
-		smtp_set_header_option(message, "Subject", Hdr_OVERRIDE, 1);
+			/* SMTP message body */
+			smtp_set_messagecb(message, readmsg_cb, (void *) part);
+		}
 	}
 
-	/* SMTP message body */
-	smtp_set_messagecb(message, readmsg_cb, (void *) req);
-
 	/* sail! */
-	if (!smtp_start_session(session)) {
-		smtperr(-EEMAILSESS, "SMTP session failed", req);
-		goto end;
-	}
+	ok = smtp_start_session(session);
+	if (!ok)
+		smtp_strerror(smtp_errno(), buf, sizeof buf);
 
-	status = smtp_message_transfer_status(message);
-	if (!status) {
-		err(-EEMAILNOSTATUS, "Could not retrieve SMTP message transfer status", NULL);
-		goto end;
-	}
+	pthread_mutex_lock(&outbox.lock);
+	for (i = 0; i < num; i++) {
+		m = mails[i];
+		m->done = time(NULL);
 
-	if (status->code != 250) {
-		err(status->code, "SMTP error", mmatic_strdup(status->text, req));
-		goto end;
-	}
+		for (j = 0; j < m->nparts; j++)
+			part_done(&m->parts[j], ok, buf);
 
-	/* success */
-	uth_set_char(req->reply, "status", status->text);
+		dbg(5, "mail %s: %s\n", m->id, m->status);
+		tlist_push(outbox.done, m);
+	}
+	pthread_mutex_unlock(&outbox.lock);
 
-end:
 	smtp_destroy_session(session);
-	auth_destroy_context(authctx);
-	auth_client_exit();
-	return ut_ok(req->reply);
 }
 
-/*****************************************/
+/** Deliver queued messages, many per SMTP session */
+static void *outbox_worker(void *arg)
+{
+	struct mail *mails[SQLER_MAIL_BATCH];
+	int num;
+
+	while (true) {
+		pthread_mutex_lock(&outbox.lock);
+		while (tlist_count(outbox.queue) == 0)
+			pthread_cond_wait(&outbox.cond, &outbox.lock);
+
+		for (num = 0; num < SQLER_MAIL_BATCH; num++) {
+			mails[num] = tlist_shift(outbox.queue);
+			if (!mails[num])
+				break;
+		}
+		pthread_mutex_unlock(&outbox.lock);
 
-static bool handle(struct req *req)
+		dbg(8, "sending %d queued messages\n", num);
+		sendmail(mails, num);
+	}
+
+	return NULL;
+}
+
+/** Check if sending to given address is allowed by "limit-domain" */
+static bool allowed(struct req *req, const char *addr)
 {
 	const char *limit, *role, *at;
 	tlist *unlimit;
-	ut *prv, *v;
-
-	prv = uth_path_create(req->prv, "sqler");
+	ut *v;
 
-	/*
-	 * handle "limit-domain"
-	 */
-	role = uth_char(prv, "role");
 	limit = uth_char(req->mod->cfg, "limit-domain");
-	if (limit) {
-		/* if in "unlimit", allow */
-		unlimit = uth_tlist(req->mod->cfg, "unlimit");
-		TLIST_ITER_LOOP(unlimit, v) {
-			if (streq(role, ut_char(v))) {
-				dbg(8, "role '%s' allowed to send anywhere\n", role);
-				goto auth_ok;
+	if (!limit)
+		return true;
+
+	/* if in "unlimit", allow */
+	role = uthp_char(req->prv, "sqler", "role");
+	unlimit = uth_tlist(req->mod->cfg, "unlimit");
+	TLIST_ITER_LOOP(unlimit, v) {
+		if (streq(role, ut_char(v)))
+			return true;
+	}
+
+	/* otherwise check recipient */
+	at = strchr(addr, '@');
+	return at && streq(at+1, limit);
+}
+
+/** Read recipients from first column of whitelisted query */
+static bool rcpts_query(struct req *req, const char *orig_sql, tlist *addrs)
+{
+	struct query *q;
+	MYSQL *conn;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	char *sql;
+
+	/* only whitelisted, argument-less queries, same as for "query" */
+	if (!check_query(req, orig_sql, &sql, &q))
+		return false;
+	if (strchr(sql, '?'))
+		return err(-EARGS, "Recipient query must not take arguments", sql);
+
+	conn = conn_get(req);
+	if (!conn)
+		return err(-ECONN, "DB connection not available", uthp_char(req->prv, "sqler", "role"));
+
+	if (mysql_query(conn, sql) != 0)
+		return sqlerr(-EQUERY, "SQL query failed");
+
+	res = mysql_store_result(conn);
+	if (!res)
+		return err(-EQUERY, "Recipient query returned no rows", sql);
+
+	while ((row = mysql_fetch_row(res))) {
+		if (row[0])
+			tlist_push(addrs, mmatic_strdup(row[0], req));
+	}
+
+	mysql_free_result(res);
+	return true;
+}
+
+/** Put message from request into outbound queue
+ * @param addrs       list of recipient addresses */
+static bool enqueue(struct req *req, tlist *addrs)
+{
+	struct mail *m;
+	struct rcpt *r;
+	struct part *part;
+	mmatic *mm;
+	const char *p;
+	ut *list;
+	int i, denied = 0;
+
+	mm = mmatic_create();
+	m = mmatic_zalloc(sizeof *m, mm);
+	m->mm = mm;
+
+	/* not guessable, status is only for the sender anyway */
+	m->id = random_hex(SQLER_MAIL_IDLEN, mm);
+	if (!m->id) {
+		mmatic_free(mm);
+		return err(-EEMAILQUEUE, "Could not generate message ID", NULL);
+	}
+
+	m->login = mmatic_strdup(uthp_char(req->prv, "sqler", "login"), mm);
+
+	m->from = mmatic_strdup(uth_char(req->params, "from"), mm);
+	m->body = crlf(uth_char(req->params, "body"), &m->bodylen, mm);
+
+	if ((p = uth_char(req->params, "from_name")))
+		m->from_name = mmatic_strdup(p, mm);
+	if ((p = uth_char(req->params, "to_name")))
+		m->to_name = mmatic_strdup(p, mm);
+	if ((p = uth_char(req->params, "subject")))
+		m->subject = mmatic_strdup(p, mm);
+
+	/* recipients, checked one by one */
+	m->nrcpts = tlist_count(addrs);
+	m->rcpts = mmatic_zalloc(sizeof(struct rcpt) * m->nrcpts, mm);
+
+	i = 0;
+	TLIST_ITER_LOOP(addrs, p) {
+		r = &m->rcpts[i++];
+		r->addr = mmatic_strdup(p, mm);
+
+		if (regexec(&outbox.addr, p, 0, NULL, 0) != 0) {
+			r->state = MAIL_FAILED;
+			r->code = -EARGS;
+			r->status = "Invalid address";
+			denied++;
+		} else if (!allowed(req, p)) {
+			r->state = MAIL_FAILED;
+			r->code = -EEMAILLIMIT;
+			r->status = "Tried to send outside of domain limit";
+			denied++;
+		}
+	}
+
+	if (denied == m->nrcpts) {
+		i = m->nrcpts;
+		mmatic_free(mm);
+
+		if (i == 1 && uth_char(req->params, "to"))
+			return err(-EEMAILLIMIT, "Tried to send outside of domain limit",
+				uth_char(req->mod->cfg, "limit-domain"));
+		else
+			return err(-EEMAILLIMIT, "No allowed recipients", NULL);
+	}
+
+	/* split into SMTP transactions */
+	m->nparts = (m->nrcpts + SQLER_MAIL_TXRCPTS - 1) / SQLER_MAIL_TXRCPTS;
+	m->parts = mmatic_zalloc(sizeof(struct part) * m->nparts, mm);
+	for (i = 0; i < m->nparts; i++) {
+		part = &m->parts[i];
+		part->m = m;
+		part->first = i * SQLER_MAIL_TXRCPTS;
+		part->last = part->first + SQLER_MAIL_TXRCPTS;
+		if (part->last > m->nrcpts)
+			part->last = m->nrcpts;
+	}
+
+	pthread_mutex_lock(&outbox.lock);
+
+	if (tlist_count(outbox.queue) >= SQLER_MAIL_QUEUE) {
+		pthread_mutex_unlock(&outbox.lock);
+		mmatic_free(mm);
+		return err(-EEMAILQUEUE, "Outbound mail queue is full", NULL);
+	}
+
+	outbox_purge();
+
+	m->state = MAIL_QUEUED;
+	thash_set(outbox.mails, m->id, m);
+	tlist_push(outbox.queue, m);
+
+	pthread_cond_signal(&outbox.cond);
+	pthread_mutex_unlock(&outbox.lock);
+
+	uth_set_char(req->reply, "id", m->id);
+	uth_set_char(req->reply, "status", mstates[MAIL_QUEUED]);
+
+	/* report recipients rejected upfront */
+	if (denied > 0) {
+		list = uth_set_tlist(req->reply, "denied", NULL);
+		for (i = 0; i < m->nrcpts; i++) {
+			if (m->rcpts[i].state == MAIL_FAILED)
+				utl_add_char(list, m->rcpts[i].addr);
+		}
+	}
+
+	return true;
+}
+
+/** Report delivery status of message */
+static bool mail_status(struct req *req, const char *id)
+{
+	struct mail *m;
+	struct rcpt *r;
+	ut *list, *item;
+	int i;
+
+	pthread_mutex_lock(&outbox.lock);
+
+	/* messages of others look like unknown ones */
+	m = thash_get(outbox.mails, id);
+	if (!m || !streq(m->login, uthp_char(req->prv, "sqler", "login"))) {
+		pthread_mutex_unlock(&outbox.lock);
+		return err(-EEMAILSTATUS, "Unknown message ID", id);
+	}
+
+	uth_set_char(req->reply, "id", id);
+	uth_set_char(req->reply, "status", mstates[m->state]);
+	if (m->state != MAIL_QUEUED) {
+		uth_set_int(req->reply, "code", m->code);
+		uth_set_char(req->reply, "text", m->status);
+	}
+
+	/* per-recipient status of bulk message */
+	if (m->nrcpts > 1) {
+		list = uth_set_tlist(req->reply, "recipients", NULL);
+		for (i = 0; i < m->nrcpts; i++) {
+			r = &m->rcpts[i];
+			item = utl_add_thash(list, NULL);
+
+			uth_set_char(item, "to", r->addr);
+			uth_set_char(item, "status", mstates[r->state]);
+			if (r->state != MAIL_QUEUED) {
+				uth_set_int(item, "code", r->code);
+				uth_set_char(item, "text", r->status);
 			}
 		}
+	}
+
+	pthread_mutex_unlock(&outbox.lock);
+	return true;
+}
 
-		/* otherwise check recipient */
-		at = strchr(uth_char(req->params, "to"), '@');
-		asnsert(at); /* guaranteed by email_fw regexp */
+/*****************************************/
+
+static bool init(struct mod *mod)
+{
+	const char *host, *port;
+	pthread_t tid;
 
-		if (!streq(at+1, limit))
-			return err(-EEMAILLIMIT, "Tried to send outside of domain limit", limit);
+	outbox.mm = mmatic_create();
+	outbox.queue = tlist_create(NULL, outbox.mm);
+	outbox.done = tlist_create(NULL, outbox.mm);
+	outbox.mails = thash_create_strkey(NULL, outbox.mm);
+
+	if (regcomp(&outbox.addr, SQLER_MAIL_ADDR, REG_EXTENDED | REG_NOSUB) != 0) {
+		dbg(0, "could not compile address regexp\n");
+		return false;
 	}
 
-auth_ok:
-	sendmail(req);
+	/* SMTP server */
+	host = uth_char(mod->cfg, "host");
+	port = uth_char(mod->cfg, "port");
+	outbox.server = mmatic_printf(outbox.mm, "%s:%s", host ? host : "localhost", port ? port : "25");
+
+	/* SMTP auth */
+	outbox.user = uth_char(mod->cfg, "user");
+	outbox.password = uth_char(mod->cfg, "password");
+
+	auth_client_init();
+	outbox.authctx = auth_create_context();
+	auth_set_mechanism_flags(outbox.authctx, AUTH_PLUGIN_PLAIN, 0);
+	auth_set_interact_cb(outbox.authctx, auth_cb, NULL);
+
+	if (pthread_create(&tid, NULL, outbox_worker, NULL) != 0) {
+		dbg(0, "could not start mail queue thread\n");
+		return false;
+	}
+
+	pthread_detach(tid);
 	return true;
 }
 
+static bool _handle(struct req *req)
+{
+	const char *id, *sql;
+	tlist *addrs, *list;
+	ut *v;
+
+	id = uth_char(req->params, "id");
+	if (id)
+		return mail_status(req, id);
+
+	if (!uth_char(req->params, "from"))
+		return err(-EARGS, "Missing parameter", "from");
+	if (!uth_char(req->params, "body"))
+		return err(-EARGS, "Missing parameter", "body");
+
+	/* collect recipients */
+	addrs = tlist_create(NULL, req);
+
+	if (uth_char(req->params, "to"))
+		tlist_push(addrs, uth_char(req->params, "to"));
+
+	list = uth_tlist(req->params, "rcpts");
+	TLIST_ITER_LOOP(list, v) {
+		if (ut_type(v) != T_STRING)
+			return err(-EARGS, "Invalid recipient", pb("%d", tlist_count(addrs)));
+
+		tlist_push(addrs, ut_char(v));
+	}
+
+	sql = uth_char(req->params, "rcpts_query");
+	if (sql && !rcpts_query(req, sql, addrs))
+		return false;
+
+	if (tlist_count(addrs) == 0)
+		return err(-EARGS, "Missing parameter", "to");
+	if (tlist_count(addrs) > SQLER_MAIL_RCPTS)
+		return err(-EARGS, "Too many recipients", pb("%d", SQLER_MAIL_RCPTS));
+
+	return enqueue(req, addrs);
+}
+
+static bool handle(struct req *req)
+{
+	bool ret;
+
+	qtable_pin(req);
+	ret = _handle(req);
+	conn_put(req);
+	qtable_put(req);
+
+	return ret;
+}
+
 struct api email_api = {
 	.tag = RPCD_TAG,
+	.init = init,
 	.handle = handle
 };
 
 struct fw email_fw[] = {
-	{ "from", true, T_STRING, "/[^ ]+@[^ ]+\\.[a-z]+$/" },  /* email of sender */
-	{   "to", true, T_STRING, "/[^ ]+@[^ ]+\\.[a-z]+$/" },  /* email of recipient */
-	{ "body", true, T_STRING, NULL },                       /* message body */
+	{ "from", false, T_STRING, "/" SQLER_MAIL_ADDR "/" },  /* email of sender */
+	{   "to", false, T_STRING, "/" SQLER_MAIL_ADDR "/" },  /* email of recipient */
+	{ "body", false, T_STRING, NULL },                       /* message body */
+	{   "id", false, T_STRING, "/^[a-f0-9]+$/" },          /* get delivery status of message */
 
 	{ "subject", false, T_STRING, NULL },                   /* message subject */
 	{ "from_name", false, T_STRING, NULL },                 /* name of sender */
 	{ "to_name", false, T_STRING, NULL },                   /* name of recipient */
+
+	{ "rcpts", false, T_LIST, NULL },                       /* bulk: list of recipient emails */
+	{ "rcpts_query", false, T_STRING, NULL },               /* bulk: whitelisted "sqler:" query giving recipients */
 	NULL,
 };
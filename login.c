@@ -5,61 +5,103 @@
  * Licensed under GPLv3
  */
 
-#include <time.h>
 #include <rpcd/rpcd_module.h>
 #include "common.h"
 
-static bool init(struct mod *mod)
-{
-	srandom(time(0));
-	return true;
-}
+#define LOGIN_QUERY "SELECT role FROM users WHERE login = ? AND password = ?"
 
-static bool handle(struct req *req)
+static bool _handle(struct req *req)
 {
 	MYSQL *conn;
-	MYSQL_RES *res;
-	MYSQL_ROW row;
-	xstr *xs;
-	const char *slogin, *spass, *sess;
-	ut *session;
+	MYSQL_STMT *stmt;
+	MYSQL_BIND param[2], result[1];
+	xstr *login, *pass;
+	char role[256];
+	unsigned long rolelen;
+	my_bool isnull;
+	bool cached;
+	const char *sess;
+	ut *dirprv;
+	int rc;
+
+	/* login is not preceded by common session check - use the admin pool */
+	uth_set_ptr(uth_path_create(req->prv, "sqler"), "pool",
+		uthp_ptr(req->mod->dir->prv, "sqler", "roles", "admin", "pool"));
+
+	conn = conn_get(req);
+	if (!conn)
+		return err(-ECONN, "DB connection not available", "admin");
+
+	stmt = stmt_get(req, LOGIN_QUERY);
+	if (!stmt)
+		return err(-EQUERY, "Preparing login query failed", LOGIN_QUERY);
+
+	login = uth_xstr(req->params, "login");
+	pass = uth_xstr(req->params, "password");
 
-	conn = uthp_ptr(req->mod->dir->prv, "sqler", "roles", "admin", "conn");
-	asnsert(conn);
+	memset(param, 0, sizeof param);
+	param[0].buffer_type = MYSQL_TYPE_STRING;
+	param[0].buffer = xstr_string(login);
+	param[0].buffer_length = xstr_length(login);
+	param[1].buffer_type = MYSQL_TYPE_STRING;
+	param[1].buffer = xstr_string(pass);
+	param[1].buffer_length = xstr_length(pass);
 
-	slogin = escape(conn, uth_xstr(req->params, "login"));
-	spass  = escape(conn, uth_xstr(req->params, "password"));
+	memset(result, 0, sizeof result);
+	result[0].buffer_type = MYSQL_TYPE_STRING;
+	result[0].buffer = role;
+	result[0].buffer_length = sizeof role;
+	result[0].length = &rolelen;
+	result[0].is_null = &isnull;
 
-	res = query_res(conn, pb(
-		"SELECT role FROM users WHERE login=\"%s\" AND password=\"%s\"",
-		slogin, spass));
+	if (mysql_stmt_bind_param(stmt, param) != 0 || mysql_stmt_execute(stmt) != 0 ||
+	    mysql_stmt_bind_result(stmt, result) != 0)
+		return err(-EQUERY, "SQL query failed",
+			pb("MySQL errno %u: %s", mysql_stmt_errno(stmt), mysql_stmt_error(stmt)));
 
-	row = mysql_fetch_row(res);
-	if (!row)
+	rc = mysql_stmt_fetch(stmt);
+	mysql_stmt_free_result(stmt);
+
+	if (rc == 1)
+		return err(-EQUERY, "SQL query failed",
+			pb("MySQL errno %u: %s", mysql_stmt_errno(stmt), mysql_stmt_error(stmt)));
+	if (rc == MYSQL_NO_DATA || isnull)
 		return err(-ELOGIN, "Login failed", "");
 
-	/* TODO: could be better */
-	xs = xstr_create(uth_char(req->params, "login"), req);
-	xstr_append(xs, pb("%u", random()));
-	sess = asn_b32_enc(xs, req);
+	/* role column is varchar(255) */
+	role[rolelen < sizeof role ? rolelen : sizeof role - 1] = '\0';
 
-	query(conn, pb(
-		"REPLACE INTO sessions SET id=\"%s\", login=\"%s\", role=\"%s\", timestamp=UNIX_TIMESTAMP()",
-		sess, slogin, row[0]));
+	sess = random_hex(SQLER_SESSION_IDLEN, req);
+	if (!sess)
+		return err(-ESESS, "Could not generate session ID", NULL);
 
-	session = uth_path_create(req->mod->dir->prv, "sqler", "sessions", sess);
-	uth_set_char(session, "login", slogin);
-	uth_set_char(session, "role", row[0]);
+	/* written to database in batches, unless cache is full or writing just failed */
+	dirprv = uth_path_create(req->mod->dir->prv, "sqler");
+	cached = session_add(dirprv, sess, xstr_string(login), role, true);
 
-	mysql_free_result(res);
+	if (!session_flush(dirprv, conn, false) || !cached) {
+		if (!query(conn, pb(
+				"REPLACE INTO sessions SET id=\"%s\", login=\"%s\", role=\"%s\", timestamp=UNIX_TIMESTAMP()",
+				sess, escape(conn, login), escape(conn, xstr_create(role, req)))))
+			return sqlerr(-EQUERY, "Storing session failed");
+	}
 
 	uth_set_char(req->reply, "session", sess);
 	return true;
 }
 
+static bool handle(struct req *req)
+{
+	bool ret;
+
+	ret = _handle(req);
+	conn_put(req);
+
+	return ret;
+}
+
 struct api login_api = {
 	.tag = RPCD_TAG,
-	.init = init,
 	.handle = handle
 };
 
@@ -6,155 +6,460 @@
  */
 
 #include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
 #include <rpcd/rpcd_module.h>
 #include "common.h"
 
-static char *get_query(struct req *req)
+/****************** Query compiler ******************/
+
+/** Placeholder kinds, see placeholder() */
+enum ph {
+	PH_NONE = 0,                 /** not a placeholder */
+	PH_LOGIN,                    /** ?login? - session login */
+	PH_ROLE,                     /** ?role? - session role */
+	PH_INT,                      /** ?int? - integer argument */
+	PH_STR,                      /** ?str? - string argument */
+	PH_DBL,                      /** ?dbl? - floating-point argument */
+	PH_ARRAY,                    /** ?array? - list argument */
+	PH_ARRAYS,                   /** ?arrays? - list of lists argument */
+	PH_OTHER,                    /** unknown keyword - eats an argument */
+};
+
+/** Literal text of a query template, followed by a placeholder */
+struct segment {
+	const char *text;            /** literal text, not NUL-terminated */
+	int len;                     /** length of text */
+	enum ph ph;                  /** placeholder after text, PH_NONE if last */
+};
+
+/** Whitelisted query, compiled at scan time */
+struct query {
+	const char *file;            /** source file the query was found in */
+	const char *stmt;            /** prepared statement form, NULL if not possible */
+	bool readonly;               /** plain SELECT, does not modify data */
+	int ttl;                     /** result cache TTL [s], 0 if not cached */
+	int timeout;                 /** execution timeout [ms], 0 for role default */
+
+	char **tables;               /** names of tables the query touches */
+	int ntables;                 /** number of tables */
+
+	struct segment *segs;        /** query template */
+	int nsegs;                   /** number of template segments */
+	int textlen;                 /** total length of literal text */
+
+	struct stats *stats;         /** statistics, set on first use */
+};
+
+/** Max. length of formatted ?int? and ?dbl? argument */
+#define FILL_NUMLEN 32
+
+/** Recognize placeholder
+ * @param s       points at '?'
+ * @param len     length of placeholder, including both '?'
+ * @return        placeholder kind, PH_NONE if not a placeholder */
+static enum ph placeholder(const char *s, int *len)
 {
-	const char *orig_query;
 	int i;
-	bool inspace = false;
-	xstr *query;
 
-	query = xstr_create("", req);
-	orig_query = uth_char(req->params, "query");
+	for (i = 1; s[i] >= 'a' && s[i] <= 'z'; i++);
+	if (s[i] != '?')
+		return PH_NONE;
 
-	i = sizeof SQLER_TAG;
-	if (i > xstr_length(uth_xstr(req->params, "query")))
-		goto end;
+	*len = i + 1;
 
-	/* skip whitechars */
-	for (; orig_query[i]; i++)
-		if (isalpha(orig_query[i]))
-			break;
+#define keyw(a) (sizeof(a) == i && strncmp((a), s + 1, i - 1) == 0)
+	if (keyw("login"))  return PH_LOGIN;
+	if (keyw("role"))   return PH_ROLE;
+	if (keyw("int"))    return PH_INT;
+	if (keyw("str"))    return PH_STR;
+	if (keyw("dbl"))    return PH_DBL;
+	if (keyw("array"))  return PH_ARRAY;
+	if (keyw("arrays")) return PH_ARRAYS;
+#undef keyw
 
-	/* replace all whitechars, newlines, etc with single space */
-	for (; orig_query[i]; i++) {
-		switch (orig_query[i]) {
-			case ' ':
-				if (inspace) continue;
-				xstr_append_char(query, orig_query[i]);
-				inspace = true;
-				break;
-			case '\t':
-			case '\r':
-			case '\n':
-				break;
-			default:
-				xstr_append_char(query, orig_query[i]);
-				inspace = false;
+	return PH_OTHER;
+}
+
+/** Is c part of an SQL identifier */
+#define isident(c) (isalnum((unsigned char) (c)) || (c) == '_' || (c) == '$' || (c) == '.' || (c) == '`')
+
+/** Check if word of given length is the keyword */
+#define isword(w, len, kw) ((len) == sizeof(kw) - 1 && strncasecmp((w), (kw), (len)) == 0)
+
+/** Find tables the query touches and check if it is read-only
+ * Tables are the identifiers following FROM, JOIN, INTO, UPDATE and TABLE,
+ * plus comma-separated lists after FROM and UPDATE. */
+static void analyze_query(struct query *q, const char *text, void *mm)
+{
+	const char *p, *w;
+	char *name, quote;
+	int len, i, j;
+	bool expect = false;         /* next identifier is a table */
+	bool list = false;           /* in table list, comma continues it */
+	bool first = true;
+
+	q->tables = mmatic_alloc(sizeof(char *) * (strlen(text) / 2 + 1), mm);
+	q->readonly = false;
+
+	for (p = text; *p;) {
+		/* skip strings */
+		if (*p == '\'' || *p == '"') {
+			for (quote = *p++; *p && *p != quote; p++) {
+				if (*p == '\\' && p[1])
+					p++;
+			}
+			if (*p)
+				p++;
+			continue;
+		}
+
+		if (!isident(*p)) {
+			if (*p == ',' && list)
+				expect = true;
+			else if (*p == '(' || *p == ')')
+				expect = list = false;
+
+			p++;
+			continue;
+		}
+
+		for (w = p; isident(*p); p++);
+		len = p - w;
+
+		if (first) {
+			q->readonly = isword(w, len, "SELECT");
+			first = false;
+		}
+
+		if (expect) {
+			/* new table name: strip quotes, normalize case */
+			name = mmatic_alloc(len + 1, mm);
+			for (i = 0, j = 0; i < len; i++) {
+				if (w[i] != '`')
+					name[j++] = tolower((unsigned char) w[i]);
+			}
+			name[j] = '\0';
+
+			for (i = 0; i < q->ntables; i++) {
+				if (streq(q->tables[i], name))
+					break;
+			}
+			if (i == q->ntables)
+				q->tables[q->ntables++] = name;
+
+			expect = false;
+		} else if (isword(w, len, "FROM") || isword(w, len, "UPDATE")) {
+			expect = list = true;
+		} else if (isword(w, len, "JOIN") || isword(w, len, "INTO") || isword(w, len, "TABLE")) {
+			expect = true;
+			list = false;
+		} else if (isword(w, len, "WHERE") || isword(w, len, "SET") || isword(w, len, "ON") ||
+		           isword(w, len, "USING") || isword(w, len, "GROUP") || isword(w, len, "ORDER") ||
+		           isword(w, len, "LIMIT") || isword(w, len, "HAVING") || isword(w, len, "VALUES") ||
+		           isword(w, len, "UNION") || isword(w, len, "SELECT")) {
+			list = false;
 		}
+
+		/* locking reads and SELECT ... INTO are not read-only */
+		if (isword(w, len, "INTO") || isword(w, len, "LOCK") ||
+		    (isword(w, len, "FOR") && strncasecmp(p, " UPDATE", 7) == 0))
+			q->readonly = false;
 	}
+}
 
-end:
-	return xstr_string(query);
+/** Compile query into a template of literal text and placeholders
+ * Prepared statement form is possible only for scalar placeholders outside
+ * of quoted strings. */
+static struct query *compile_query(const char *query, const char *file, void *mm)
+{
+	struct query *q;
+	struct segment *seg;
+	const char *text;
+	xstr *stmt;
+	enum ph ph;
+	int i, len, start = 0;
+	char quote = 0;
+	bool prepare = true;
+
+	q = mmatic_zalloc(sizeof *q, mm);
+	q->file = file ? mmatic_strdup(file, mm) : NULL;
+
+	/* each placeholder takes at least 2 chars */
+	text = mmatic_strdup(query, mm);
+	q->segs = mmatic_alloc(sizeof(struct segment) * (strlen(text) / 2 + 1), mm);
+
+	for (i = 0; text[i]; i++) {
+		if (quote) {
+			if (text[i] == '\\' && text[i+1]) {
+				i++;
+				continue;
+			} else if (text[i] == quote) {
+				quote = 0;
+			}
+		} else if (text[i] == '\'' || text[i] == '"' || text[i] == '`') {
+			quote = text[i];
+		}
+
+		if (text[i] != '?')
+			continue;
+
+		ph = placeholder(text + i, &len);
+		if (ph == PH_NONE) {
+			prepare = false; /* would be taken for a parameter marker */
+			continue;
+		}
+
+		/* placeholders inside quotes are substituted in fill_query() only */
+		if (quote || ph == PH_ARRAY || ph == PH_ARRAYS)
+			prepare = false;
+
+		seg = &q->segs[q->nsegs++];
+		seg->text = text + start;
+		seg->len = i - start;
+		seg->ph = ph;
+		q->textlen += seg->len;
+
+		i += len - 1;
+		start = i + 1;
+	}
+
+	seg = &q->segs[q->nsegs++];
+	seg->text = text + start;
+	seg->len = i - start;
+	seg->ph = PH_NONE;
+	q->textlen += seg->len;
+
+	analyze_query(q, text, mm);
+
+	if (prepare) {
+		stmt = xstr_create("", mm);
+		for (i = 0; i < q->nsegs; i++) {
+			xstr_append_size(stmt, q->segs[i].text, q->segs[i].len);
+			if (q->segs[i].ph != PH_NONE && q->segs[i].ph != PH_OTHER)
+				xstr_append_char(stmt, '?');
+		}
+		q->stmt = xstr_string(stmt);
+	}
+
+	return q;
 }
 
-/* this probably needs a wise rewrite */
-static char *fill_query(struct req *req, char *orig_query, tlist *data)
+/** Upper bound of formatted ?array? argument size */
+static size_t list_size(ut *arg)
 {
-	int i, qs;
-	enum fq_state { NORMAL, INQ } state = NORMAL;
-	xstr *query;
-	MYSQL *conn;
-	ut *arg, *el, *el2;
-	tlist *list, *list2;
-	bool atleastone, atleastone2;
-
-#define iskeyw(a) (sizeof(a) == i - qs && strncmp((a), orig_query + qs + 1, sizeof(a) - 1) == 0)
-
-/* XXX: uses list and el */
-#define appendlist(utlist) do {                        \
-	atleastone = false;                                \
-	xstr_append(query, "(");                           \
-	list = ut_tlist(utlist);                           \
-	TLIST_ITER_LOOP(list, el) {                        \
-		if (atleastone)                                \
-			xstr_append_char(query, ',');              \
-		xstr_append(query,                             \
-			pb("\"%s\"", escape(conn, ut_xstr(el))));  \
-		atleastone = true;                             \
-	}                                                  \
-	xstr_append(query, ")");                           \
-} while(0);
-
-	conn = uthp_ptr(req->prv, "sqler", "conn");
-	query = xstr_create("", req);
-	tlist_reset(data);
-
-	for (i = 0; orig_query[i]; i++) {
-		switch (state) {
-			case NORMAL:
-				if (orig_query[i] == '?') {
-					qs = i;
-					state = INQ;
-				} else {
-					xstr_append_char(query, orig_query[i]);
-				}
-				break;
+	tlist *list;
+	ut *el;
+	size_t size = 2;
 
-			case INQ:
-				if (orig_query[i] == '?') {
-					if (iskeyw("login")) {
-						xstr_append(query, pb("\"%s\"", uthp_char(req->prv, "sqler", "login")));
-					} else if (iskeyw("role")) {
-						xstr_append(query, pb("\"%s\"", uthp_char(req->prv, "sqler", "role")));
-					} else { /* probably needs an arg */
-						arg = tlist_iter(data);
-						if (arg) {
-							if (iskeyw("int")) {
-								xstr_append(query, pb("%d", ut_int(arg)));
-							} else if (iskeyw("str")) {
-								xstr_append(query, pb("\"%s\"", escape(conn, ut_xstr(arg))));
-							} else if (iskeyw("dbl")) {
-								xstr_append(query, pb("%g", ut_double(arg)));
-							} else if (iskeyw("login")) {
-								xstr_append(query, pb("\"%s\"", uthp_char(req->prv, "sqler", "login")));
-							} else if (iskeyw("role")) {
-								xstr_append(query, pb("\"%s\"", uthp_char(req->prv, "sqler", "role")));
-							} else if (iskeyw("array")) {
-								appendlist(arg);
-							} else if (iskeyw("arrays")) {
-								atleastone2 = false;
-
-								list2 = ut_tlist(arg);
-								TLIST_ITER_LOOP(list2, el2) {
-									if (atleastone2)
-										xstr_append_char(query, ',');
-
-									appendlist(el2);
-									atleastone2 = true;
-								}
-							}
-
-							/* XXX: arg eaten by unrecognizible substitution */
-						}
-					}
+	list = ut_tlist(arg);
+	TLIST_ITER_LOOP(list, el)
+		size += xstr_length(ut_xstr(el)) * 2 + 3;
+
+	return size;
+}
+
+/** Rows of ?arrays? argument to use instead of all, see run_bulk() */
+struct slice {
+	ut **rows;                   /** all rows */
+	int first;                   /** first row to use */
+	int num;                     /** number of rows to use */
+};
+
+/** Upper bound of formatted argument size
+ * @param sl          part of ?arrays? to use, may be NULL */
+static size_t arg_size(enum ph ph, ut *arg, struct slice *sl)
+{
+	tlist *list;
+	ut *el;
+	size_t size = 0;
+	int i;
+
+	switch (ph) {
+		case PH_INT:
+		case PH_DBL:
+			return FILL_NUMLEN;
+		case PH_STR:
+			return xstr_length(ut_xstr(arg)) * 2 + 2;
+		case PH_ARRAY:
+			return list_size(arg);
+		case PH_ARRAYS:
+			if (sl) {
+				for (i = 0; i < sl->num; i++)
+					size += list_size(sl->rows[sl->first + i]) + 1;
+				return size;
+			}
+
+			list = ut_tlist(arg);
+			TLIST_ITER_LOOP(list, el)
+				size += list_size(el) + 1;
+			return size;
+		default:
+			return 0;
+	}
+}
+
+/** Write quoted and escaped string */
+static char *put_str(char *p, MYSQL *conn, const char *str, size_t len)
+{
+	*p++ = '"';
+	p += mysql_real_escape_string(conn, p, str, len);
+	*p++ = '"';
+	return p;
+}
+
+/** Write ?array? argument */
+static char *put_list(char *p, MYSQL *conn, ut *arg)
+{
+	tlist *list;
+	ut *el;
+	xstr *xs;
+	bool atleastone = false;
+
+	*p++ = '(';
+
+	list = ut_tlist(arg);
+	TLIST_ITER_LOOP(list, el) {
+		if (atleastone)
+			*p++ = ',';
 
-					state = NORMAL;
-				} else if (orig_query[i] < 'a' || orig_query[i] > 'z') {
-rollback:
-					while (qs <= i)
-						xstr_append_char(query, orig_query[qs++]);
-					state = NORMAL;
+		xs = ut_xstr(el);
+		p = put_str(p, conn, xstr_string(xs), xstr_length(xs));
+		atleastone = true;
+	}
+
+	*p++ = ')';
+	return p;
+}
+
+/** Write argument in place of placeholder
+ * @param sl          part of ?arrays? to use, may be NULL */
+static char *put_arg(char *p, MYSQL *conn, enum ph ph, ut *arg, struct slice *sl)
+{
+	tlist *list;
+	ut *el;
+	xstr *xs;
+	bool atleastone = false;
+	int i;
+
+	switch (ph) {
+		case PH_INT:
+			return p + snprintf(p, FILL_NUMLEN, "%d", ut_int(arg));
+		case PH_DBL:
+			return p + snprintf(p, FILL_NUMLEN, "%g", ut_double(arg));
+		case PH_STR:
+			xs = ut_xstr(arg);
+			return put_str(p, conn, xstr_string(xs), xstr_length(xs));
+		case PH_ARRAY:
+			return put_list(p, conn, arg);
+		case PH_ARRAYS:
+			if (sl) {
+				for (i = 0; i < sl->num; i++) {
+					if (i > 0)
+						*p++ = ',';
+					p = put_list(p, conn, sl->rows[sl->first + i]);
 				}
-				break;
-		}
+				return p;
+			}
+
+			list = ut_tlist(arg);
+			TLIST_ITER_LOOP(list, el) {
+				if (atleastone)
+					*p++ = ',';
+
+				p = put_list(p, conn, el);
+				atleastone = true;
+			}
+			return p;
+		default:
+			return p; /* arg eaten by unrecognizible substitution */
+	}
+}
+
+/** Fill query template with request arguments
+ * The output size is computed first, so the query is built in a single buffer.
+ * @param sl          part of ?arrays? to use, may be NULL
+ * @param buf         buffer to reuse, NULL to allocate in request arena */
+static char *fill_slice(struct req *req, struct query *q, tlist *data, struct slice *sl, struct tbuf *buf)
+{
+	MYSQL *conn;
+	const char *login, *role;
+	struct segment *seg;
+	size_t size;
+	char *query, *p;
+	ut *arg;
+	int i;
+
+	conn = conn_get(req);
+	login = uthp_char(req->prv, "sqler", "login");
+	role = uthp_char(req->prv, "sqler", "role");
+
+	/* compute output size */
+	size = q->textlen + 1;
+	if (data)
+		tlist_reset(data);
+
+	for (i = 0; i < q->nsegs; i++) {
+		seg = &q->segs[i];
+
+		if (seg->ph == PH_LOGIN)
+			size += strlen(login) * 2 + 2;
+		else if (seg->ph == PH_ROLE)
+			size += strlen(role) * 2 + 2;
+		else if (seg->ph != PH_NONE && data && (arg = tlist_iter(data)))
+			size += arg_size(seg->ph, arg, sl);
+	}
+
+	/* write it */
+	query = p = buf ? tbuf_get(buf, size) : arena_alloc(req, size);
+	if (data)
+		tlist_reset(data);
+
+	for (i = 0; i < q->nsegs; i++) {
+		seg = &q->segs[i];
+
+		memcpy(p, seg->text, seg->len);
+		p += seg->len;
+
+		if (seg->ph == PH_LOGIN)
+			p = put_str(p, conn, login, strlen(login));
+		else if (seg->ph == PH_ROLE)
+			p = put_str(p, conn, role, strlen(role));
+		else if (seg->ph != PH_NONE && data && (arg = tlist_iter(data)))
+			p = put_arg(p, conn, seg->ph, arg, sl);
 	}
 
-	dbg(8, "fill_query: '%s'\n", xstr_string(query));
+	*p = '\0';
 
-	return xstr_string(query);
+	dbg(8, "fill_query: '%s'\n", query);
+
+	return query;
+}
+
+/** Fill query template with request arguments */
+static char *fill_query(struct req *req, struct query *q, tlist *data)
+{
+	return fill_slice(req, q, data, NULL, NULL);
 }
 
 /****************** SQL query scanner ******************/
 
 static void scan_file(ut *queries, const char *filepath)
 {
-	int i, j;
-	bool inspace = false;
-	char *file, *orig_query;
-	xstr *query;
+	int i;
+	size_t len;
+	char *file, *orig_query, *query;
 
 	file = asn_readfile(filepath, queries);
 	if (!file) {
@@ -179,26 +484,12 @@ static void scan_file(ut *queries, const char *filepath)
 				orig_query = asn_trim(file);
 
 				/* replace all whitechars, newlines, etc with single space */
-				query = xstr_create("", queries);
-				for (j = 0; orig_query[j]; j++) {
-					switch (orig_query[j]) {
-						case ' ':
-							if (inspace) continue;
-							xstr_append_char(query, orig_query[j]);
-							inspace = true;
-							break;
-						case '\t':
-						case '\r':
-						case '\n':
-							break;
-						default:
-							xstr_append_char(query, orig_query[j]);
-							inspace = false;
-					}
-				}
+				len = strlen(orig_query);
+				query = mmatic_alloc(len + 1, queries);
+				text_squeeze(query, orig_query, len);
 
-				dbg(10, "%s: %s\n", filepath, xstr_string(query));
-				uth_set_char(queries, xstr_string(query), filepath);
+				dbg(10, "%s: %s\n", filepath, query);
+				uth_set_ptr(queries, query, compile_query(query, filepath, queries));
 
 				file += i + 2;
 				break;
@@ -207,152 +498,2713 @@ static void scan_file(ut *queries, const char *filepath)
 	}
 }
 
-static void scan_dir(ut *queries, const char *dirpath, const char *ext)
+/****************** Hot reload ******************/
+
+/** Queries found in one source file */
+struct sfile {
+	mmatic *mm;                  /** memory of this file's queries */
+	const char *path;            /** file path */
+	time_t mtime;                /** modification time when scanned */
+	long mtime_ns;               /** its nanoseconds */
+	off_t size;                  /** size when scanned */
+	ut *queries;                 /** normalized query -> struct query */
+	int refs;                    /** query tables using it, plus one while loaded; atomic */
+};
+
+/** Queries of a file as recorded in manifest */
+struct mentry {
+	time_t mtime;                /** modification time */
+	long mtime_ns;               /** its nanoseconds, 0 if not recorded */
+	off_t size;                  /** size */
+	char **queries;              /** normalized queries */
+	int num;                     /** number of queries */
+};
+
+/** File to scan during startup */
+struct job {
+	struct role *role;           /** role the file belongs to */
+	const char *path;            /** file path */
+	struct sfile *sf;            /** result */
+};
+
+/** Sources of a role */
+struct role {
+	const char *name;            /** role name */
+	thash *files;                /** path -> struct sfile */
+	struct qslot *slot;          /** where query table is published */
+	bool dirty;                  /** files changed since last publish */
+};
+
+/** Watched directory */
+struct watch {
+	struct role *role;           /** role the sources belong to */
+	const char *dir;             /** directory path */
+	const char *ext;             /** extension of scanned files, or NULL */
+	const char *file;            /** name of the only scanned file, or NULL */
+	const char *path;            /** path of the only scanned file, or NULL */
+};
+
+/** Files a published query table takes its queries from */
+struct tfiles {
+	struct qtable t;             /** must be first */
+	struct sfile **files;        /** pinned files */
+	int num;                     /** number of files */
+};
+
+/** Hot reload state, used by init() and then only by reload_thread() */
+static struct {
+	mmatic *mm;                  /** memory for structures below */
+	tlist *roles;                /** struct role */
+	int fd;                      /** inotify descriptor, -1 if not watching */
+	thash *watches;              /** watch descriptor -> tlist of struct watch */
+	ut *ttls;                    /** per-query result cache TTLs */
+	int ttl;                     /** default result cache TTL */
+	ut *timeouts;                /** per-query execution timeouts */
+
+	tlist *jobs;                 /** during startup: files to scan in parallel */
+	const char *manifest;        /** path of manifest, may be NULL */
+	thash *mentries;             /** during startup: path -> struct mentry */
+} reload = { .fd = -1 };
+
+/** Release file, free its queries if no query table uses them */
+static void sfile_unref(struct sfile *sf)
+{
+	if (__atomic_sub_fetch(&sf->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		mmatic_free(sf->mm);
+}
+
+/** Free query table no request uses anymore
+ * @note called from any thread, see qtable_unref() */
+static void table_release(struct qtable *t)
 {
-	tlist *ls;
-	const char *name, *path, *dot;
+	struct tfiles *tf = (struct tfiles *) t;
+	int i;
 
-	ls = asn_ls(dirpath, queries);
-	TLIST_ITER_LOOP(ls, name) {
-		path = mmatic_printf(queries, "%s/%s", dirpath, name);
+	for (i = 0; i < tf->num; i++)
+		sfile_unref(tf->files[i]);
 
-		if (asn_isdir(path) == 1) {
-			scan_dir(queries, path, ext);
-			continue;
-		}
+	mmatic_free(t->mm);
+}
+
+/** Watch directory for changes of scanned sources
+ * @param ext         watch files with given extension
+ * @param path        watch just given file */
+static void watch_add(struct role *rl, const char *dir, const char *ext, const char *path)
+{
+	struct watch *w;
+	tlist *list;
+	char *key;
+	int wd;
+
+	if (reload.fd < 0)
+		return;
+
+	wd = inotify_add_watch(reload.fd, dir,
+		IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE);
+	if (wd < 0) {
+		dbg(1, "watching %s failed: %s\n", dir, strerror(errno));
+		return;
+	}
 
-		dot = strchr(name, '.');
-		if (!dot) continue;
-		if (!streq(dot + 1, ext)) continue;
+	w = mmatic_zalloc(sizeof *w, reload.mm);
+	w->role = rl;
+	w->dir = mmatic_strdup(dir, reload.mm);
+	if (ext)
+		w->ext = mmatic_strdup(ext, reload.mm);
+	if (path) {
+		w->path = mmatic_strdup(path, reload.mm);
+		w->file = strrchr(w->path, '/') ? strrchr(w->path, '/') + 1 : w->path;
+	}
 
-		scan_file(queries, path);
+	/* one directory may be watched for many roles */
+	key = mmatic_printf(reload.mm, "%d", wd);
+	list = thash_get(reload.watches, key);
+	if (!list) {
+		list = tlist_create(NULL, reload.mm);
+		thash_set(reload.watches, key, list);
 	}
+
+	tlist_push(list, w);
 }
 
-/*******************************************************/
+/** Forget queries of given file */
+static void unload_file(struct role *rl, const char *path)
+{
+	struct sfile *sf;
 
-static bool init(struct mod *mod)
+	sf = thash_get(rl->files, path);
+	if (!sf)
+		return;
+
+	thash_set(rl->files, path, NULL);
+	sfile_unref(sf);
+	rl->dirty = true;
+}
+
+/** Scan given file, or take its queries from manifest if unchanged
+ * @note called from many threads during startup */
+static struct sfile *parse_file(const char *path)
 {
-	thash *scan;
-	tlist *scanlist;
-	ut *v, *queries, *scandef;
-	const char *rolename;
-	char *path, *ext, *ast;
+	struct sfile *sf;
+	struct mentry *me = NULL;
+	struct query *q;
+	struct stat st;
+	mmatic *mm;
+	thash *qh;
+	const char *query;
+	char *key;
+	ut *v;
+	int i;
 
-	/*
-	 * scan source code for sql queries
-	 */
-	scan = uth_thash(mod->cfg, "scan");
-	THASH_ITER_LOOP(scan, rolename, v) {
-		/* create storage point */
-		queries = uth_path_create(mod->dir->prv, "sqler", "roles", rolename, "queries");
+	mm = mmatic_create();
+	sf = mmatic_zalloc(sizeof *sf, mm);
+	sf->mm = mm;
+	sf->path = mmatic_strdup(path, mm);
+	sf->queries = ut_new_thash(thash_create_strkey(NULL, mm), mm);
+	sf->refs = 1;
 
-		scanlist = ut_tlist(v);
-		TLIST_ITER_LOOP(scanlist, scandef) {
-			/* unconst */
-			path = mmatic_strdup(ut_char(scandef), mod);
+	if (stat(path, &st) == 0) {
+		sf->mtime = st.st_mtim.tv_sec;
+		sf->mtime_ns = st.st_mtim.tv_nsec;
+		sf->size = st.st_size;
+	}
 
-			/* get dir path and file extension */
-			ext = NULL;
-			ast = strchr(path, '*');
-			if (ast) {
-				*ast = '\0';
-				if (ast[1] == '.')
-					ext = ast + 2;
-				else
-					ext = ast + 1;
+	if (reload.mentries)
+		me = thash_get(reload.mentries, path);
 
-				if (!ext[0])
-					ext = SQLER_DEFAULT_EXT;
+	/* whole seconds would miss quick edits */
+	if (me && me->mtime == sf->mtime && me->mtime_ns == sf->mtime_ns && me->size == sf->size) {
+		dbg(10, "%s: unchanged, %d queries\n", path, me->num);
 
-				scan_dir(queries, path, ext);
-			} else {
-				scan_file(queries, path);
-			}
+		for (i = 0; i < me->num; i++) {
+			key = mmatic_strdup(me->queries[i], mm);
+			uth_set_ptr(sf->queries, key, compile_query(key, path, sf->queries));
 		}
+	} else {
+		scan_file(sf->queries, path);
 	}
 
-	return true;
+	/* set result cache TTLs and timeouts */
+	qh = ut_thash(sf->queries);
+	THASH_ITER_LOOP(qh, query, v) {
+		q = ut_ptr(v);
+		q->ttl = (reload.ttls && uth_get(reload.ttls, query)) ? uth_int(reload.ttls, query) : reload.ttl;
+		q->timeout = reload.timeouts ? uth_int(reload.timeouts, query) : 0;
+	}
+
+	return sf;
 }
 
-static bool handle(struct req *req)
+/** Replace queries of file */
+static void add_file(struct role *rl, struct sfile *sf)
 {
-	MYSQL *conn;
-	thash *queries;
-	char *query;
+	unload_file(rl, sf->path);
+	thash_set(rl->files, sf->path, sf);
+	rl->dirty = true;
+}
+
+/** (Re)scan given file, or queue it if starting up */
+static void load_file(struct role *rl, const char *path)
+{
+	struct job *job;
+
+	if (reload.jobs) {
+		job = mmatic_zalloc(sizeof *job, reload.mm);
+		job->role = rl;
+		job->path = mmatic_strdup(path, reload.mm);
+		tlist_push(reload.jobs, job);
+		return;
+	}
 
-	conn = uthp_ptr(req->prv, "sqler", "conn");
-	queries = uthp_thash(req->prv, "sqler", "queries");
-	asnsert(conn);
+	add_file(rl, parse_file(path));
+}
 
-	/******* check the query *******/
-	query = get_query(req);
-	if (queries && !thash_get(queries, query))
-		return err(-EDENY, "Access denied", query);
+/** Scan queued files in parallel */
+static struct {
+	struct job **jobs;
+	int num;
+	int next;                    /** next job to take, atomic */
+} scanning;
 
-	/******* make the query ********/
-	MYSQL_RES *res;
+static void *scan_thread(void *arg)
+{
+	int i;
 
-	query = fill_query(req, query, uth_tlist(req->params, "data"));
-	dbg(5, "executing: %s\n", query);
+	while ((i = __atomic_fetch_add(&scanning.next, 1, __ATOMIC_RELAXED)) < scanning.num)
+		scanning.jobs[i]->sf = parse_file(scanning.jobs[i]->path);
+
+	return NULL;
+}
 
-	if (mysql_query(conn, query) != 0)
-		return sqlerr(-EQUERY, "SQL query failed");
+static void scan_jobs(int threads)
+{
+	pthread_t *tids;
+	struct job *job;
+	int i;
 
-	/* check if we need to fetch anything back */
-	res = mysql_store_result(conn);
+	scanning.num = tlist_count(reload.jobs);
+	scanning.jobs = mmatic_alloc(sizeof(struct job *) * (scanning.num + 1), reload.mm);
+	scanning.next = 0;
 
-	if (!res) {
-		/* probably an UPDATE, INSERT, etc. - fetch num of affected rows */
-		uth_set_int(req->reply, "insert_id", mysql_insert_id(conn));
-		uth_set_int(req->reply, "affected", mysql_affected_rows(conn));
-		mysql_free_result(res);
-		return true; /* we're done */
-	} else {
-		/* a SELECT -- fetch num of rows */
-		uth_set_int(req->reply, "rowcount", mysql_num_rows(res));
+	i = 0;
+	TLIST_ITER_LOOP(reload.jobs, job)
+		scanning.jobs[i++] = job;
+
+	if (threads > scanning.num)
+		threads = scanning.num;
+
+	dbg(3, "scanning %d files in %d threads\n", scanning.num, threads);
+
+	tids = mmatic_alloc(sizeof(pthread_t) * (threads + 1), reload.mm);
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&tids[i], NULL, scan_thread, NULL) != 0)
+			break;
 	}
 
-	/******* fetch the results ********/
-	MYSQL_FIELD *fields;
-	MYSQL_ROW mrow;
-	ut *row, *rows, *columns;
-	unsigned int i, num;
+	/* also scan here, in case no thread could start */
+	scan_thread(NULL);
 
-	rows = uth_set_tlist(req->reply, "rows", NULL);
-	fields = mysql_fetch_fields(res);
-	num = mysql_num_fields(res);
+	while (--i >= 0)
+		pthread_join(tids[i], NULL);
 
-	if (uth_bool(req->params, "verbose")) {
-		while ((mrow = mysql_fetch_row(res))) {
-			row = utl_add_thash(rows, NULL);
+	for (i = 0; i < scanning.num; i++)
+		add_file(scanning.jobs[i]->role, scanning.jobs[i]->sf);
+}
 
-			for (i = 0; i < num; i++) {
-				if (mrow[i] == NULL)
-					uth_set_null(row, fields[i].name);
-				else
-					uth_set_char(row, fields[i].name, mrow[i]);
+/** Read manifest of previous run */
+static void manifest_read(void *mm)
+{
+	struct mentry *me = NULL;
+	char *file, *line, *save, *mtime, *size, *path, *ns;
+
+	reload.mentries = thash_create_strkey(NULL, mm);
+
+	file = asn_readfile(reload.manifest, mm);
+	if (!file)
+		return;
+
+	for (line = strtok_r(file, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+		if (line[0] == 'F' && line[1] == '\t') {
+			mtime = line + 2;
+			size = strchr(mtime, '\t');
+			path = size ? strchr(size + 1, '\t') : NULL;
+			if (!path) {
+				me = NULL;
+				continue;
 			}
+
+			*size++ = '\0';
+			*path++ = '\0';
+
+			me = mmatic_zalloc(sizeof *me, mm);
+			me->mtime = strtoll(mtime, &ns, 10);
+			if (*ns == '.')
+				me->mtime_ns = strtol(ns + 1, NULL, 10);
+			me->size = strtoll(size, NULL, 10);
+			thash_set(reload.mentries, path, me);
+		} else if (line[0] == 'Q' && line[1] == '\t' && me) {
+			me->queries = mmatic_realloc(me->queries, sizeof(char *) * (me->num + 1), mm);
+			me->queries[me->num++] = line + 2;
 		}
-	} else {
-		ut *columns = uth_set_tlist(req->reply, "columns", NULL);
+	}
 
-		for (i = 0; i < num; i++)
-			utl_add_char(columns, fields[i].name);
+	dbg(3, "manifest %s: %u files\n", reload.manifest, thash_count(reload.mentries));
+}
 
-		while ((mrow = mysql_fetch_row(res))) {
-			row = utl_add_tlist(rows, NULL);
+/** Write queries of all scanned files to manifest */
+static void manifest_write(void)
+{
+	struct role *rl;
+	struct sfile *sf;
+	mmatic *mm;
+	thash *done, *qh;
+	const char *path, *query;
+	char *tmp;
+	ut *v;
+	FILE *fp;
 
-			for (i = 0; i < num; i++) {
-				if (mrow[i] == NULL)
-					utl_add_null(row);
-				else
-					utl_add_char(row, mrow[i]);
-			}
+	if (!reload.manifest)
+		return;
+
+	mm = mmatic_create();
+	done = thash_create_strkey(NULL, mm);
+	tmp = mmatic_printf(mm, "%s.tmp", reload.manifest);
+
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		dbg(1, "writing manifest %s failed: %s\n", tmp, strerror(errno));
+		goto end;
+	}
+
+	TLIST_ITER_LOOP(reload.roles, rl) {
+		THASH_ITER_LOOP(rl->files, path, sf) {
+			/* may be scanned for many roles */
+			if (thash_get(done, path) || strchr(path, '\n'))
+				continue;
+			thash_set(done, path, sf);
+
+			fprintf(fp, "F\t%lld.%09ld\t%lld\t%s\n",
+				(long long) sf->mtime, sf->mtime_ns, (long long) sf->size, path);
+
+			qh = ut_thash(sf->queries);
+			THASH_ITER_LOOP(qh, query, v)
+				fprintf(fp, "Q\t%s\n", query);
 		}
 	}
 
-	return true;
+	if (fclose(fp) != 0 || rename(tmp, reload.manifest) != 0)
+		dbg(1, "writing manifest %s failed: %s\n", reload.manifest, strerror(errno));
+
+end:
+	mmatic_free(mm);
+}
+
+/** Check if file name has given extension */
+static bool has_ext(const char *name, const char *ext)
+{
+	const char *dot;
+
+	dot = strchr(name, '.');
+	return dot && streq(dot + 1, ext);
+}
+
+static void scan_dir(struct role *rl, const char *dirpath, const char *ext)
+{
+	mmatic *mm;
+	tlist *ls;
+	const char *name, *path;
+
+	watch_add(rl, dirpath, ext, NULL);
+
+	mm = mmatic_create();
+	ls = asn_ls(dirpath, mm);
+	TLIST_ITER_LOOP(ls, name) {
+		path = mmatic_printf(mm, "%s/%s", dirpath, name);
+
+		if (asn_isdir(path) == 1) {
+			scan_dir(rl, path, ext);
+			continue;
+		}
+
+		if (!has_ext(name, ext)) continue;
+
+		load_file(rl, path);
+	}
+
+	mmatic_free(mm);
+}
+
+/** Build query table of role and replace the published one */
+static void publish(struct role *rl)
+{
+	struct tfiles *tf;
+	struct qtable *t;
+	struct sfile *sf;
+	mmatic *mm;
+	thash *qh;
+	const char *path, *query;
+	ut *table, *v;
+
+	mm = mmatic_create();
+	tf = mmatic_zalloc(sizeof *tf, mm);
+	tf->files = mmatic_alloc(sizeof(struct sfile *) * (thash_count(rl->files) + 1), mm);
+
+	t = &tf->t;
+	t->mm = mm;
+	t->queries = thash_create_strkey(NULL, mm);
+	t->refs = 1;
+	t->release = table_release;
+	table = ut_new_thash(t->queries, mm);
+
+	/* queries stay in memory of their files, pin them */
+	THASH_ITER_LOOP(rl->files, path, sf) {
+		__atomic_add_fetch(&sf->refs, 1, __ATOMIC_RELAXED);
+		tf->files[tf->num++] = sf;
+
+		qh = ut_thash(sf->queries);
+		THASH_ITER_LOOP(qh, query, v)
+			uth_set_ptr(table, query, ut_ptr(v));
+	}
+
+	qtable_publish(rl->slot, t);
+
+	rl->dirty = false;
+	dbg(3, "role %s: %u queries\n", rl->name, thash_count(t->queries));
+}
+
+/** Handle change in watched directory */
+static void reload_event(struct inotify_event *ev)
+{
+	struct watch *w;
+	tlist *list;
+	char key[16], path[PATH_MAX];
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		dbg(1, "inotify queue overflow, some source changes may be missed\n");
+		return;
+	}
+
+	if (!ev->len)
+		return;
+
+	snprintf(key, sizeof key, "%d", ev->wd);
+	list = thash_get(reload.watches, key);
+
+	TLIST_ITER_LOOP(list, w) {
+		if (ev->mask & IN_ISDIR) {
+			/* new subdirectory */
+			if (w->ext && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+				snprintf(path, sizeof path, "%s/%s", w->dir, ev->name);
+				scan_dir(w->role, path, w->ext);
+			}
+			continue;
+		}
+
+		if (w->file) {
+			if (!streq(ev->name, w->file)) continue;
+			snprintf(path, sizeof path, "%s", w->path);
+		} else {
+			if (!has_ext(ev->name, w->ext)) continue;
+			snprintf(path, sizeof path, "%s/%s", w->dir, ev->name);
+		}
+
+		dbg(5, "role %s: %s changed\n", w->role->name, path);
+
+		if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+			unload_file(w->role, path);
+		else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+			load_file(w->role, path);
+	}
+}
+
+/** Rescan changed sources and publish new query tables */
+static void *reload_thread(void *arg)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfd = { .fd = reload.fd, .events = POLLIN };
+	struct inotify_event *ev;
+	struct role *rl;
+	ssize_t len;
+	char *p;
+	int timeout;
+	bool changed;
+
+	while (true) {
+		/* wait for changes, then until they settle */
+		timeout = -1;
+		while (poll(&pfd, 1, timeout) > 0) {
+			len = read(reload.fd, buf, sizeof buf);
+			if (len <= 0)
+				break;
+
+			for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+				ev = (struct inotify_event *) p;
+				reload_event(ev);
+			}
+
+			timeout = SQLER_RELOAD_DELAY;
+		}
+
+		changed = false;
+		TLIST_ITER_LOOP(reload.roles, rl) {
+			if (rl->dirty) {
+				publish(rl);
+				changed = true;
+			}
+		}
+
+		if (changed)
+			manifest_write();
+	}
+
+	return NULL;
+}
+
+/****************** Result cache ******************/
+
+/** Cached result of a query */
+struct centry {
+	mmatic *mm;                  /** memory of this entry */
+	const char *key;             /** cache key, see cache_key() */
+	char **tables;               /** tables the query reads, copy of q->tables */
+	int ntables;                 /** number of tables */
+	time_t expires;              /** expiration time */
+	unsigned long *versions;     /** versions of tables at execution time */
+
+	MYSQL_FIELD *fields;         /** column definitions */
+	unsigned int num;            /** number of columns */
+	char **cells;                /** values, row by row */
+	unsigned long *lens;         /** lengths of values, row by row */
+	unsigned long rows;          /** number of rows */
+	unsigned long size;          /** allocated rows in cells */
+	bool toobig;                 /** exceeded SQLER_CACHE_ROWS, do not cache */
+
+	int refs;                    /** number of readers */
+	bool queued;                 /** in cache.fifo */
+	bool dead;                   /** evicted, free when unused */
+
+	bool landed;                 /** flight finished, see flight_end() */
+	bool ok;                     /** flight succeeded and result is complete */
+};
+
+/** Result cache, shared by all roles */
+static struct {
+	pthread_mutex_t lock;        /** protects everything below and entry refs */
+	mmatic *mm;                  /** memory for cache structures */
+	thash *entries;              /** key -> struct centry */
+	tlist *fifo;                 /** entries in insertion order, for eviction */
+	thash *tables;               /** table name -> unsigned long version */
+	int max;                     /** max. number of entries */
+
+	bool coalesce;               /** share results of identical concurrent queries */
+	thash *flights;              /** key -> struct centry of query being executed */
+	pthread_cond_t landed;       /** signaled when a flight finishes */
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .landed = PTHREAD_COND_INITIALIZER };
+
+/** Get version counter of given table, bumped on each write
+ * @note call with cache.lock held */
+static unsigned long *table_version(const char *table)
+{
+	unsigned long *v;
+
+	v = thash_get(cache.tables, table);
+	if (!v) {
+		v = mmatic_zalloc(sizeof *v, cache.mm);
+		thash_set(cache.tables, mmatic_strdup(table, cache.mm), v);
+	}
+
+	return v;
+}
+
+/** Size of cache key part of argument */
+static size_t cache_key_size(ut *arg)
+{
+	tlist *list;
+	ut *el;
+	size_t size;
+
+	if (ut_type(arg) == T_LIST) {
+		size = 2;
+		list = ut_tlist(arg);
+		TLIST_ITER_LOOP(list, el)
+			size += cache_key_size(el);
+		return size;
+	} else {
+		return 2 * FILL_NUMLEN + xstr_length(ut_xstr(arg));
+	}
+}
+
+/** Write cache key part of argument */
+static char *cache_key_arg(char *p, ut *arg)
+{
+	tlist *list;
+	ut *el;
+	xstr *xs;
+
+	if (ut_type(arg) == T_LIST) {
+		*p++ = '[';
+		list = ut_tlist(arg);
+		TLIST_ITER_LOOP(list, el)
+			p = cache_key_arg(p, el);
+		*p++ = ']';
+	} else {
+		/* type and length make the key unambiguous */
+		xs = ut_xstr(arg);
+		p += sprintf(p, "%d:%d:", ut_type(arg), xstr_length(xs));
+		memcpy(p, xstr_string(xs), xstr_length(xs));
+		p += xstr_length(xs);
+	}
+
+	return p;
+}
+
+/** Make cache key of query executed in given request
+ * @param query       normalized query
+ * @note valid until next call in the same thread */
+static char *cache_key(struct req *req, struct query *q, const char *query, tlist *data)
+{
+	static __thread struct tbuf buf;
+	const char *role, *login = "";
+	size_t size, len;
+	char *key, *p;
+	ut *arg;
+	int i;
+
+	role = uthp_char(req->prv, "sqler", "role");
+	for (i = 0; i < q->nsegs; i++) {
+		if (q->segs[i].ph == PH_LOGIN) {
+			login = uthp_char(req->prv, "sqler", "login");
+			break;
+		}
+	}
+
+	size = strlen(role) + strlen(login) + strlen(query) + 4;
+	if (data) {
+		TLIST_ITER_LOOP(data, arg)
+			size += cache_key_size(arg);
+	}
+
+	key = p = tbuf_get(&buf, size);
+
+	len = strlen(role);
+	memcpy(p, role, len);
+	p += len;
+	*p++ = '\n';
+
+	len = strlen(login);
+	memcpy(p, login, len);
+	p += len;
+	*p++ = '\n';
+
+	len = strlen(query);
+	memcpy(p, query, len);
+	p += len;
+	*p++ = '\n';
+
+	if (data) {
+		TLIST_ITER_LOOP(data, arg)
+			p = cache_key_arg(p, arg);
+	}
+
+	*p = '\0';
+	return key;
+}
+
+static void cache_free(struct centry *e)
+{
+	mmatic_free(e->mm);
+}
+
+/** Find valid cached result
+ * @note call cache_release() when done
+ * @retval NULL       not in cache */
+static struct centry *cache_get(const char *key)
+{
+	struct centry *e;
+	time_t now = time(NULL);
+	int i;
+
+	pthread_mutex_lock(&cache.lock);
+
+	e = thash_get(cache.entries, key);
+	if (!e || now >= e->expires)
+		goto miss;
+
+	for (i = 0; i < e->ntables; i++) {
+		if (*table_version(e->tables[i]) != e->versions[i])
+			goto miss;
+	}
+
+	e->refs++;
+	pthread_mutex_unlock(&cache.lock);
+	return e;
+
+miss:
+	pthread_mutex_unlock(&cache.lock);
+	return NULL;
+}
+
+/** Stop using entry returned by cache_get() */
+static void cache_release(struct centry *e)
+{
+	pthread_mutex_lock(&cache.lock);
+
+	e->refs--;
+	if (e->dead && !e->queued && e->refs == 0)
+		cache_free(e);
+
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/** Make new cache entry
+ * @note call with cache.lock held */
+static struct centry *cache_new(struct query *q, const char *key)
+{
+	struct centry *e;
+	mmatic *mm;
+	int i;
+
+	mm = mmatic_create();
+	e = mmatic_zalloc(sizeof *e, mm);
+	e->mm = mm;
+	e->key = mmatic_strdup(key, mm);
+	e->expires = time(NULL) + q->ttl;
+	e->versions = mmatic_alloc(sizeof(unsigned long) * (q->ntables + 1), mm);
+
+	/* q may be freed on reload before entry expires */
+	e->ntables = q->ntables;
+	e->tables = mmatic_alloc(sizeof(char *) * (q->ntables + 1), mm);
+	for (i = 0; i < q->ntables; i++)
+		e->tables[i] = mmatic_strdup(q->tables[i], mm);
+
+	/* any write from now on invalidates the entry */
+	for (i = 0; i < q->ntables; i++)
+		e->versions[i] = *table_version(q->tables[i]);
+
+	return e;
+}
+
+/** Start new cache entry, to be filled with results of query about to be executed */
+static struct centry *cache_start(struct query *q, const char *key)
+{
+	struct centry *e;
+
+	pthread_mutex_lock(&cache.lock);
+	e = cache_new(q, key);
+	pthread_mutex_unlock(&cache.lock);
+
+	return e;
+}
+
+/** Store column definitions in entry */
+static void cache_fields(struct centry *e, MYSQL_FIELD *fields, unsigned int num)
+{
+	unsigned int i;
+
+	e->num = num;
+	e->fields = mmatic_alloc(sizeof(MYSQL_FIELD) * num, e->mm);
+	memcpy(e->fields, fields, sizeof(MYSQL_FIELD) * num);
+
+	/* only name is used out of all strings */
+	for (i = 0; i < num; i++) {
+		e->fields[i].name = mmatic_strdup(fields[i].name, e->mm);
+		e->fields[i].org_name = e->fields[i].table = e->fields[i].org_table = e->fields[i].db = NULL;
+	}
+}
+
+/** Store a copy of row in entry
+ * @param lengths     lengths of values, NULL if NUL-terminated */
+static void cache_row(struct centry *e, MYSQL_ROW mrow, unsigned long *lengths)
+{
+	unsigned int i;
+	unsigned long *lens;
+	char **cells;
+
+	if (e->toobig)
+		return;
+
+	if (e->rows == SQLER_CACHE_ROWS) {
+		e->toobig = true;
+		return;
+	}
+
+	if (e->rows == e->size) {
+		e->size = e->size ? e->size * 2 : 64;
+		e->cells = mmatic_realloc(e->cells, sizeof(char *) * e->num * e->size, e->mm);
+		e->lens = mmatic_realloc(e->lens, sizeof(unsigned long) * e->num * e->size, e->mm);
+	}
+
+	/* values may contain NUL bytes */
+	cells = e->cells + e->rows * e->num;
+	lens = e->lens + e->rows * e->num;
+	for (i = 0; i < e->num; i++) {
+		if (!mrow[i]) {
+			cells[i] = NULL;
+			lens[i] = 0;
+			continue;
+		}
+
+		lens[i] = lengths ? lengths[i] : strlen(mrow[i]);
+		cells[i] = mmatic_alloc(lens[i] + 1, e->mm);
+		memcpy(cells[i], mrow[i], lens[i]);
+		cells[i][lens[i]] = '\0';
+	}
+
+	e->rows++;
+}
+
+/** Put filled entry in cache, or free it */
+static void cache_put(struct centry *e, bool ok)
+{
+	struct centry *old;
+
+	if (!ok || e->toobig) {
+		cache_free(e);
+		return;
+	}
+
+	pthread_mutex_lock(&cache.lock);
+
+	/* replace older result */
+	old = thash_get(cache.entries, e->key);
+	if (old)
+		old->dead = true;
+
+	thash_set(cache.entries, e->key, e);
+	tlist_push(cache.fifo, e);
+	e->queued = true;
+
+	/* evict oldest */
+	while (tlist_count(cache.fifo) > cache.max) {
+		old = tlist_shift(cache.fifo);
+		old->queued = false;
+
+		if (!old->dead) {
+			thash_set(cache.entries, old->key, NULL);
+			old->dead = true;
+		}
+
+		if (old->refs == 0)
+			cache_free(old);
+	}
+
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/** Join identical query being executed, or start executing it
+ * @param ms          max. time to wait for the other query [ms]
+ * @param e           entry of the flight
+ * @retval true       started: fill *e with results, then call flight_end()
+ * @retval false      joined: *e finished, its result valid if (*e)->ok;
+ *                    call cache_release() when done; *e is NULL if waiting
+ *                    timed out */
+static bool flight_start(struct query *q, const char *key, int ms, struct centry **e)
+{
+	struct centry *f;
+	struct timespec until;
+	int i;
+
+	pthread_mutex_lock(&cache.lock);
+
+	/* do not join flights started before a write we might depend on */
+	f = thash_get(cache.flights, key);
+	for (i = 0; f && i < f->ntables; i++) {
+		if (*table_version(f->tables[i]) != f->versions[i])
+			f = NULL;
+	}
+
+	if (f) {
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += ms / 1000;
+		until.tv_nsec += (long) (ms % 1000) * 1000000;
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+
+		f->refs++;
+		while (!f->landed) {
+			if (pthread_cond_timedwait(&cache.landed, &cache.lock, &until) == ETIMEDOUT)
+				break;
+		}
+
+		/* the flight holds a reference until it lands */
+		if (!f->landed) {
+			f->refs--;
+			f = NULL;
+		}
+
+		pthread_mutex_unlock(&cache.lock);
+		*e = f;
+		return false;
+	}
+
+	f = cache_new(q, key);
+	f->refs = 1;
+	thash_set(cache.flights, f->key, f);
+
+	pthread_mutex_unlock(&cache.lock);
+	*e = f;
+	return true;
+}
+
+/** Finish flight, wake up requests waiting for its result
+ * @param keep        put result in cache */
+static void flight_end(struct centry *e, bool ok, bool keep)
+{
+	pthread_mutex_lock(&cache.lock);
+	if (thash_get(cache.flights, e->key) == e)
+		thash_set(cache.flights, e->key, NULL);
+	e->landed = true;
+	/* only a result set can be shared: waiters run other statements on their own */
+	e->ok = ok && !e->toobig && e->fields;
+	pthread_cond_broadcast(&cache.landed);
+	pthread_mutex_unlock(&cache.lock);
+
+	if (keep && e->ok) {
+		cache_put(e, true);
+	} else {
+		pthread_mutex_lock(&cache.lock);
+		e->dead = true;
+		pthread_mutex_unlock(&cache.lock);
+	}
+
+	/* free now, or when the last waiter is done */
+	cache_release(e);
+}
+
+/** Invalidate cached results of queries touching the same tables as q */
+static void cache_invalidate(struct query *q)
+{
+	int i;
+
+	pthread_mutex_lock(&cache.lock);
+	for (i = 0; i < q->ntables; i++)
+		(*table_version(q->tables[i]))++;
+	pthread_mutex_unlock(&cache.lock);
+}
+
+/****************** Query results ******************/
+
+/** Result set, read through result_fetch() */
+struct result {
+	void *mm;                    /** memory for buffers */
+	unsigned long limit;         /** max. number of rows to fetch, 0 for all */
+	unsigned long count;         /** number of rows fetched so far */
+	bool eof;                    /** all rows fetched */
+
+	struct centry *cache;        /** replay of cached result, if not NULL */
+	unsigned long pos;           /** next row of cached result */
+	struct centry *record;       /** store fetched rows in this entry, if not NULL */
+
+	MYSQL *conn;                 /** connection the result comes from */
+	MYSQL_RES *res;              /** result set, or just metadata for stmt */
+	MYSQL_STMT *stmt;            /** prepared statement, NULL for text protocol */
+	bool stream;                 /** rows are read from server one by one */
+	bool failed;                 /** fetching rows failed */
+	MYSQL_FIELD *fields;         /** column definitions */
+	unsigned int num;            /** number of columns */
+
+	uint64_t fetch_ns;           /** time spent fetching rows from MySQL */
+	unsigned long bytes;         /** size of values fetched so far */
+
+	/* binary protocol only */
+	MYSQL_BIND *bind;            /** output buffers */
+	unsigned long *lengths;      /** lengths of values in current row */
+	my_bool *nulls;              /** NULL flags of current row */
+	char **row;                  /** current row */
+};
+
+/** Minimal size of binary protocol output buffer */
+#define RESULT_BUFSIZE 64
+
+/** Start reading result of executed prepared statement
+ * @param mm          memory for buffers
+ * @param stream      do not buffer the whole result set on client side
+ * @retval false      statement did not return a result set */
+static bool result_stmt(void *mm, struct result *r, MYSQL_STMT *stmt, bool stream)
+{
+	my_bool yes = 1;
+	unsigned long size;
+	unsigned int i;
+
+	memset(r, 0, sizeof *r);
+	r->mm = mm;
+
+	r->res = mysql_stmt_result_metadata(stmt);
+	if (!r->res)
+		return false;
+
+	r->stmt = stmt;
+	r->stream = stream;
+
+	/* learn max. column sizes, unless streaming */
+	if (!stream) {
+		mysql_stmt_attr_set(stmt, STMT_ATTR_UPDATE_MAX_LENGTH, &yes);
+		mysql_stmt_store_result(stmt);
+	}
+
+	r->fields = mysql_fetch_fields(r->res);
+	r->num = mysql_num_fields(r->res);
+
+	r->bind    = mmatic_zalloc(sizeof(MYSQL_BIND) * r->num, mm);
+	r->lengths = mmatic_zalloc(sizeof(unsigned long) * r->num, mm);
+	r->nulls   = mmatic_zalloc(sizeof(my_bool) * r->num, mm);
+	r->row     = mmatic_zalloc(sizeof(char *) * r->num, mm);
+
+	/* fetch everything as strings */
+	for (i = 0; i < r->num; i++) {
+		size = r->fields[i].max_length + 1;
+		if (size < RESULT_BUFSIZE)
+			size = RESULT_BUFSIZE;
+
+		r->bind[i].buffer_type = MYSQL_TYPE_STRING;
+		r->bind[i].buffer = mmatic_alloc(size, mm);
+		r->bind[i].buffer_length = size;
+		r->bind[i].length = &r->lengths[i];
+		r->bind[i].is_null = &r->nulls[i];
+	}
+
+	mysql_stmt_bind_result(stmt, r->bind);
+	return true;
+}
+
+/** Start reading result of query sent through text protocol
+ * @param mm          memory for buffers
+ * @param stream      do not buffer the whole result set on client side
+ * @retval false      query did not return a result set */
+static bool result_store(void *mm, struct result *r, MYSQL *conn, bool stream)
+{
+	memset(r, 0, sizeof *r);
+	r->mm = mm;
+
+	r->conn = conn;
+	r->stream = stream;
+	r->res = stream ? mysql_use_result(conn) : mysql_store_result(conn);
+	if (!r->res)
+		return false;
+
+	r->fields = mysql_fetch_fields(r->res);
+	r->num = mysql_num_fields(r->res);
+	return true;
+}
+
+/** Start reading result of query executed by async_run()
+ * @retval false      query did not return a result set */
+static bool result_async(void *mm, struct result *r, struct aquery *aq)
+{
+	memset(r, 0, sizeof *r);
+	r->mm = mm;
+
+	r->conn = aq->conn->mysql;
+	r->res = aq->res;
+	if (!r->res)
+		return false;
+
+	r->fields = mysql_fetch_fields(r->res);
+	r->num = mysql_num_fields(r->res);
+	return true;
+}
+
+/** Start replaying cached result */
+static void result_cached(struct result *r, struct centry *e)
+{
+	memset(r, 0, sizeof *r);
+
+	r->cache = e;
+	r->fields = e->fields;
+	r->num = e->num;
+}
+
+/** Start storing fetched rows in cache entry */
+static void result_record(struct result *r, struct centry *e)
+{
+	r->record = e;
+	cache_fields(e, r->fields, r->num);
+}
+
+/** Fetch next row from MySQL */
+static MYSQL_ROW result_next(struct result *r)
+{
+	MYSQL_ROW mrow;
+	unsigned int i;
+	int rc;
+	bool rebind = false;
+
+	if (!r->stmt) {
+		mrow = mysql_fetch_row(r->res);
+
+		/* with mysql_use_result(), NULL may also mean an error */
+		if (!mrow && r->stream && mysql_errno(r->conn) != 0)
+			r->failed = true;
+
+		return mrow;
+	}
+
+	rc = mysql_stmt_fetch(r->stmt);
+	if (rc == 1)
+		r->failed = true;
+	if (rc == 1 || rc == MYSQL_NO_DATA)
+		return NULL;
+
+	for (i = 0; i < r->num; i++) {
+		if (r->nulls[i]) {
+			r->row[i] = NULL;
+			continue;
+		}
+
+		/* value did not fit - grow the buffer and fetch again */
+		if (r->lengths[i] >= r->bind[i].buffer_length) {
+			r->bind[i].buffer_length = r->lengths[i] + 1;
+			r->bind[i].buffer = mmatic_alloc(r->bind[i].buffer_length, r->mm);
+			mysql_stmt_fetch_column(r->stmt, &r->bind[i], i, 0);
+			rebind = true;
+		}
+
+		r->row[i] = r->bind[i].buffer;
+		r->row[i][r->lengths[i]] = '\0';
+	}
+
+	if (rebind)
+		mysql_stmt_bind_result(r->stmt, r->bind);
+
+	return r->row;
+}
+
+/** Lengths of values in current row
+ * @retval NULL       not known, values are NUL-terminated */
+static unsigned long *result_lengths(struct result *r)
+{
+	if (r->cache)
+		return r->pos > 0 ? r->cache->lens + r->num * (r->pos - 1) : NULL;
+	else if (r->stmt)
+		return r->lengths;
+	else
+		return mysql_fetch_lengths(r->res);
+}
+
+/** Size of values in row */
+static unsigned long row_bytes(struct result *r, MYSQL_ROW mrow)
+{
+	unsigned long *lengths, n = 0;
+	unsigned int i;
+
+	lengths = result_lengths(r);
+	for (i = 0; i < r->num; i++) {
+		if (mrow[i])
+			n += lengths ? lengths[i] : strlen(mrow[i]);
+	}
+
+	return n;
+}
+
+/** Fetch next row
+ * @retval NULL       no more rows, or r->limit reached */
+static MYSQL_ROW result_fetch(struct result *r)
+{
+	MYSQL_ROW mrow;
+	uint64_t start;
+
+	if (r->limit && r->count == r->limit)
+		return NULL;
+
+	if (r->cache) {
+		mrow = r->pos < r->cache->rows ? r->cache->cells + r->num * r->pos++ : NULL;
+	} else {
+		start = stats_clock();
+		mrow = result_next(r);
+		r->fetch_ns += stats_clock() - start;
+
+		if (mrow && r->record)
+			cache_row(r->record, mrow, result_lengths(r));
+	}
+
+	if (mrow) {
+		r->count++;
+		r->bytes += row_bytes(r, mrow);
+	} else {
+		r->eof = true;
+	}
+
+	return mrow;
+}
+
+static void result_free(struct result *r)
+{
+	if (r->cache)
+		return;
+
+	if (r->stmt)
+		mysql_stmt_free_result(r->stmt);
+
+	mysql_free_result(r->res);
+}
+
+/** Report failure of fetching rows */
+static bool result_err(struct req *req, struct result *r)
+{
+	if (r->stmt)
+		return err(-EQUERY, "Fetching rows failed",
+			pb("MySQL errno %u: %s", mysql_stmt_errno(r->stmt), mysql_stmt_error(r->stmt)));
+	else
+		return err(-EQUERY, "Fetching rows failed",
+			pb("MySQL errno %u: %s", mysql_errno(r->conn), mysql_error(r->conn)));
+}
+
+/** Put result rows in reply
+ * @retval false      fetching rows failed, error set in reply */
+static bool reply_rows(struct req *req, struct result *r, ut *reply)
+{
+	MYSQL_ROW mrow;
+	ut *row, *rows, *columns;
+	unsigned int i, count = 0;
+
+	rows = uth_set_tlist(reply, "rows", NULL);
+
+	if (uth_bool(req->params, "verbose")) {
+		while ((mrow = result_fetch(r))) {
+			row = utl_add_thash(rows, NULL);
+			count++;
+
+			for (i = 0; i < r->num; i++) {
+				if (mrow[i] == NULL)
+					uth_set_null(row, r->fields[i].name);
+				else
+					uth_set_char(row, r->fields[i].name, mrow[i]);
+			}
+		}
+	} else {
+		columns = uth_set_tlist(reply, "columns", NULL);
+
+		for (i = 0; i < r->num; i++)
+			utl_add_char(columns, r->fields[i].name);
+
+		while ((mrow = result_fetch(r))) {
+			row = utl_add_tlist(rows, NULL);
+			count++;
+
+			for (i = 0; i < r->num; i++) {
+				if (mrow[i] == NULL)
+					utl_add_null(row);
+				else
+					utl_add_char(row, mrow[i]);
+			}
+		}
+	}
+
+	if (r->failed)
+		return result_err(req, r);
+
+	/* known only after reading all rows in stream mode */
+	uth_set_int(reply, "rowcount", count);
+	return true;
+}
+
+/** Column value types in "columns" result format */
+enum ctype {
+	CT_STRING = 0,
+	CT_INT,
+	CT_DBL,
+	CT_BOOL,
+};
+
+/** Column being built in "columns" result format */
+struct column {
+	enum ctype type;             /** value type */
+	ut *values;                  /** list of values, unless dictionary-encoded */
+
+	/* dictionary encoding */
+	thash *dict;                 /** value -> index + 1 */
+	char **uniques;              /** distinct values, in order of appearance */
+	int nuniques;                /** number of distinct values */
+	int *idx;                    /** value indices, -1 for NULL */
+	int size;                    /** size of idx */
+};
+
+/** Max. number of distinct values in dictionary-encoded column */
+#define DICT_MAX 1024
+
+/** Largest integer exactly representable as double */
+#define DBL_INTMAX 9007199254740992LL
+
+/** Map MySQL column type to value type */
+static enum ctype column_type(MYSQL_FIELD *field)
+{
+	switch (field->type) {
+		case MYSQL_TYPE_BIT:
+			return field->length == 1 ? CT_BOOL : CT_STRING;
+		case MYSQL_TYPE_TINY:
+			if (field->length == 1)
+				return CT_BOOL;
+			/* fall-through */
+		case MYSQL_TYPE_SHORT:
+		case MYSQL_TYPE_LONG:
+		case MYSQL_TYPE_INT24:
+		case MYSQL_TYPE_LONGLONG:
+		case MYSQL_TYPE_YEAR:
+			return CT_INT;
+		case MYSQL_TYPE_FLOAT:
+		case MYSQL_TYPE_DOUBLE:
+			return CT_DBL;
+		default:
+			return CT_STRING; /* including DECIMAL, to keep it exact */
+	}
+}
+
+/** Add typed value to list */
+static void column_add(ut *list, enum ctype type, MYSQL_FIELD *field, const char *val)
+{
+	long long ival;
+
+	switch (type) {
+		case CT_BOOL:
+			if (field->type == MYSQL_TYPE_BIT)
+				utl_add_bool(list, val[0] != 0);
+			else
+				utl_add_bool(list, atoi(val) != 0);
+			break;
+		case CT_INT:
+			ival = strtoll(val, NULL, 10);
+			if (ival >= INT_MIN && ival <= INT_MAX)
+				utl_add_int(list, ival);
+			else if (ival >= -DBL_INTMAX && ival <= DBL_INTMAX)
+				utl_add_double(list, ival);
+			else
+				utl_add_char(list, val);
+			break;
+		case CT_DBL:
+			utl_add_double(list, strtod(val, NULL));
+			break;
+		default:
+			utl_add_char(list, val);
+			break;
+	}
+}
+
+/** Put result in reply in column-major order, with native value types
+ * Low-cardinality string columns are dictionary-encoded if requested: their
+ * values are indices into the matching "dicts" entry.
+ * @retval false      fetching rows failed, error set in reply */
+static bool reply_columns(struct req *req, struct result *r, ut *reply)
+{
+	struct column *cols, *col;
+	MYSQL_ROW mrow;
+	ut *columns, *types, *data, *dicts, *list;
+	bool dict;
+	intptr_t idx;
+	int count = 0, j;
+	unsigned int i;
+	static const char *type_names[] = { "string", "int", "double", "bool" };
+
+	dict = uth_bool(req->params, "dict");
+	cols = arena_alloc(req, sizeof(struct column) * r->num);
+	memset(cols, 0, sizeof(struct column) * r->num);
+
+	columns = uth_set_tlist(reply, "columns", NULL);
+	types = uth_set_tlist(reply, "types", NULL);
+	data = uth_set_tlist(reply, "data", NULL);
+
+	for (i = 0; i < r->num; i++) {
+		col = &cols[i];
+		col->type = column_type(&r->fields[i]);
+
+		utl_add_char(columns, r->fields[i].name);
+		utl_add_char(types, type_names[col->type]);
+
+		col->values = utl_add_tlist(data, NULL);
+
+		if (dict && col->type == CT_STRING) {
+			col->dict = thash_create_strkey(NULL, req);
+			col->size = 64;
+			col->idx = mmatic_alloc(sizeof(int) * col->size, req);
+			col->uniques = mmatic_alloc(sizeof(char *) * (DICT_MAX + 1), req);
+		}
+	}
+
+	while ((mrow = result_fetch(r))) {
+		for (i = 0; i < r->num; i++) {
+			col = &cols[i];
+
+			if (!col->dict) {
+				if (mrow[i] == NULL)
+					utl_add_null(col->values);
+				else
+					column_add(col->values, col->type, &r->fields[i], mrow[i]);
+				continue;
+			}
+
+			if (count == col->size) {
+				col->size *= 2;
+				col->idx = mmatic_realloc(col->idx, sizeof(int) * col->size, req);
+			}
+
+			if (mrow[i] == NULL) {
+				col->idx[count] = -1;
+				continue;
+			}
+
+			idx = (intptr_t) thash_get(col->dict, mrow[i]);
+			if (!idx) {
+				/* too many - give up on dictionary, convert what we have */
+				if (col->nuniques == DICT_MAX) {
+					for (j = 0; j < count; j++) {
+						if (col->idx[j] < 0)
+							utl_add_null(col->values);
+						else
+							utl_add_char(col->values, col->uniques[col->idx[j]]);
+					}
+
+					utl_add_char(col->values, mrow[i]);
+					col->dict = NULL;
+					continue;
+				}
+
+				col->uniques[col->nuniques] = mmatic_strdup(mrow[i], req);
+				idx = ++col->nuniques;
+				thash_set(col->dict, col->uniques[idx - 1], (void *) idx);
+			}
+
+			col->idx[count] = idx - 1;
+		}
+
+		count++;
+	}
+
+	if (r->failed)
+		return result_err(req, r);
+
+	/* encode dictionary candidates now that their cardinality is known */
+	dicts = dict ? uth_set_tlist(reply, "dicts", NULL) : NULL;
+	for (i = 0; dict && i < r->num; i++) {
+		col = &cols[i];
+
+		/* worth it? */
+		if (!col->dict || col->nuniques * 2 > count) {
+			utl_add_null(dicts);
+		} else {
+			list = utl_add_tlist(dicts, NULL);
+			for (j = 0; j < col->nuniques; j++)
+				utl_add_char(list, col->uniques[j]);
+		}
+
+		if (!col->dict)
+			continue;
+
+		for (j = 0; j < count; j++) {
+			if (col->idx[j] < 0)
+				utl_add_null(col->values);
+			else if (col->nuniques * 2 <= count)
+				utl_add_int(col->values, col->idx[j]);
+			else
+				utl_add_char(col->values, col->uniques[col->idx[j]]);
+		}
+	}
+
+	uth_set_int(reply, "rowcount", count);
+	return true;
+}
+
+/** Put result rows in reply as JSON text
+ * Same layout as non-verbose "rows", but encoded straight from MySQL rows
+ * into one string, instead of a ut node per value.
+ * @retval false      fetching rows failed, error set in reply */
+static bool reply_json(struct req *req, struct result *r, ut *reply)
+{
+	MYSQL_ROW mrow;
+	unsigned long *lengths, len;
+	size_t size, need, used;
+	unsigned int i, count = 0;
+	ut *columns;
+	char *buf, *p;
+
+	columns = uth_set_tlist(reply, "columns", NULL);
+	for (i = 0; i < r->num; i++)
+		utl_add_char(columns, r->fields[i].name);
+
+	size = SQLER_ARENA_CHUNK;
+	buf = p = mmatic_alloc(size, req);
+	*p++ = '[';
+
+	while ((mrow = result_fetch(r))) {
+		lengths = result_lengths(r);
+
+		/* worst case: every byte escaped as \u00XX; separators; closing "]" */
+		need = 8 * r->num + 6;
+		for (i = 0; i < r->num; i++) {
+			if (mrow[i])
+				need += 6 * (lengths ? lengths[i] : strlen(mrow[i]));
+		}
+
+		used = p - buf;
+		if (used + need > size) {
+			while (used + need > size)
+				size *= 2;
+
+			buf = mmatic_realloc(buf, size, req);
+			p = buf + used;
+		}
+
+		if (count++ > 0)
+			*p++ = ',';
+
+		*p++ = '[';
+		for (i = 0; i < r->num; i++) {
+			if (i > 0)
+				*p++ = ',';
+
+			if (!mrow[i]) {
+				memcpy(p, "null", 4);
+				p += 4;
+				continue;
+			}
+
+			len = lengths ? lengths[i] : strlen(mrow[i]);
+			*p++ = '"';
+			p += text_json(p, mrow[i], len);
+			*p++ = '"';
+		}
+		*p++ = ']';
+	}
+
+	*p++ = ']';
+	*p = '\0';
+
+	if (r->failed)
+		return result_err(req, r);
+
+	uth_set_char(reply, "json", buf);
+	mmatic_freeptr(buf);
+
+	uth_set_int(reply, "rowcount", count);
+	return true;
+}
+
+/** Put result in reply, in requested format */
+static bool reply_result(struct req *req, struct result *r, ut *reply)
+{
+	const char *format = uth_char(req->params, "format");
+
+	if (format && streq(format, "columns"))
+		return reply_columns(req, r, reply);
+	else if (format && streq(format, "json"))
+		return reply_json(req, r, reply);
+	else
+		return reply_rows(req, r, reply);
+}
+
+/** Execute whitelisted query as prepared statement, binding request arguments */
+static bool stmt_execute(struct req *req, MYSQL_STMT *stmt, struct query *q, tlist *data)
+{
+	static __thread struct tbuf buf;
+	MYSQL_BIND *bind;
+	union { long long i; double d; } *vals;
+	const char *str;
+	xstr *xs;
+	ut *arg;
+	enum ph ph;
+	int i, j;
+
+	/* binds and numeric values in one reused buffer */
+	bind = (MYSQL_BIND *) tbuf_get(&buf, (sizeof *bind + sizeof *vals) * q->nsegs);
+	vals = (void *) (bind + q->nsegs);
+	memset(bind, 0, sizeof *bind * q->nsegs);
+
+	if (data)
+		tlist_reset(data);
+
+	for (i = 0, j = 0; i < q->nsegs; i++) {
+		ph = q->segs[i].ph;
+
+		switch (ph) {
+			case PH_NONE:
+				continue;
+
+			case PH_LOGIN:
+			case PH_ROLE:
+				str = uthp_char(req->prv, "sqler", ph == PH_LOGIN ? "login" : "role");
+				bind[j].buffer_type = MYSQL_TYPE_STRING;
+				bind[j].buffer = (char *) str;
+				bind[j].buffer_length = strlen(str);
+				break;
+
+			default:
+				arg = data ? tlist_iter(data) : NULL;
+				if (ph == PH_OTHER)
+					continue;
+
+				if (!arg) {
+					bind[j].buffer_type = MYSQL_TYPE_NULL;
+				} else if (ph == PH_INT) {
+					vals[j].i = ut_int(arg);
+					bind[j].buffer_type = MYSQL_TYPE_LONGLONG;
+					bind[j].buffer = &vals[j].i;
+				} else if (ph == PH_DBL) {
+					vals[j].d = ut_double(arg);
+					bind[j].buffer_type = MYSQL_TYPE_DOUBLE;
+					bind[j].buffer = &vals[j].d;
+				} else {
+					xs = ut_xstr(arg);
+					bind[j].buffer_type = MYSQL_TYPE_STRING;
+					bind[j].buffer = xstr_string(xs);
+					bind[j].buffer_length = xstr_length(xs);
+				}
+				break;
+		}
+
+		j++;
+	}
+
+	dbg(5, "executing prepared: %s\n", q->stmt);
+
+	/* error reported by caller, see execute_once() */
+	return mysql_stmt_bind_param(stmt, bind) == 0 && mysql_stmt_execute(stmt) == 0;
+}
+
+/** Execute checked query once, see execute()
+ * @param retry       do not report lost connection, query will be repeated
+ * @retval -2         connection lost, error not set in reply */
+static int execute_once(struct req *req, char *query, struct query *q, tlist *data, ut *reply,
+	struct result *r, bool stream, void *mm, uint64_t *ns, bool retry)
+{
+	MYSQL *conn;
+	MYSQL_STMT *stmt;
+	uint64_t start;
+	bool res;
+
+	conn = conn_route(req, q && q->readonly);
+	if (!conn) {
+		err(-ECONN, "DB connection not available", uthp_char(req->prv, "sqler", "role"));
+		return -1;
+	}
+
+	if (q && q->stmt && (stmt = stmt_get(req, q->stmt))) {
+		/* use binary protocol if possible */
+		start = stats_clock();
+		if (!stmt_execute(req, stmt, q, data)) {
+			if (retry && conn_lost(mysql_stmt_errno(stmt)))
+				return -2;
+
+			err(-EQUERY, "SQL query failed",
+				pb("MySQL errno %u: %s", mysql_stmt_errno(stmt), mysql_stmt_error(stmt)));
+			return -1;
+		}
+
+		res = result_stmt(mm, r, stmt, stream);
+		if (ns)
+			ns[ST_QUERY] = stats_clock() - start;
+		if (res)
+			return 1;
+
+		/* probably an UPDATE, INSERT, etc. - fetch num of affected rows */
+		uth_set_int(reply, "insert_id", mysql_stmt_insert_id(stmt));
+		uth_set_int(reply, "affected", mysql_stmt_affected_rows(stmt));
+	} else {
+		/* no whitelist for this role - compile on the fly */
+		if (!q)
+			q = compile_query(query, NULL, req);
+
+		start = stats_clock();
+		query = fill_query(req, q, data);
+		dbg(5, "executing: %s\n", query);
+
+		if (ns) {
+			ns[ST_FILL] = stats_clock() - start;
+			start += ns[ST_FILL];
+		}
+
+		if (mysql_query(conn, query) != 0) {
+			if (retry && conn_lost(mysql_errno(conn)))
+				return -2;
+
+			sqlerr(-EQUERY, "SQL query failed");
+			return -1;
+		}
+
+		/* check if we need to fetch anything back */
+		res = result_store(mm, r, conn, stream);
+		if (ns)
+			ns[ST_QUERY] = stats_clock() - start;
+		if (res)
+			return 1;
+
+		/* probably an UPDATE, INSERT, etc. - fetch num of affected rows */
+		uth_set_int(reply, "insert_id", mysql_insert_id(conn));
+		uth_set_int(reply, "affected", mysql_affected_rows(conn));
+	}
+
+	cache_invalidate(q);
+	return 0;
+}
+
+/** Execution timeout of query on given connection [ms] */
+static int query_timeout(struct dbconn *conn, struct query *q)
+{
+	return (q && q->timeout > 0) ? q->timeout : conn->pool->timeout;
+}
+
+/** Start deadline of query on connection of current request */
+static void query_deadline(struct req *req, struct query *q, struct deadline *d)
+{
+	struct dbconn *conn;
+
+	conn_route(req, q && q->readonly);
+	conn = uthp_ptr(req->prv, "sqler", "dbconn");
+	deadline_start(d, conn, conn ? query_timeout(conn, q) : 0);
+}
+
+/** Execute checked query
+ * Read-only queries outside of transactions are repeated once, on a new
+ * connection, if the connection was lost.
+ * @param query       normalized query
+ * @param q           compiled query, NULL if role has no whitelist
+ * @param r           result set, if any
+ * @param mm          memory for result buffers
+ * @param dl          deadline started with query_deadline(), moved to the new connection
+ * @retval -1         failed, error set in reply
+ * @retval 0          no result set, number of affected rows put in reply
+ * @retval 1          result set available in r */
+static int execute(struct req *req, char *query, struct query *q, tlist *data, ut *reply,
+	struct result *r, bool stream, void *mm, uint64_t *ns, struct deadline *dl)
+{
+	bool retry;
+	int rc;
+
+	retry = q && q->readonly && !uth_bool(uth_path_create(req->prv, "sqler"), "trx");
+
+	rc = execute_once(req, query, q, data, reply, r, stream, mm, ns, retry);
+	if (rc == -2) {
+		dbg(1, "role %s: connection lost, repeating query\n", uthp_char(req->prv, "sqler", "role"));
+
+		/* connection was lost while being killed */
+		if (deadline_stop(dl)) {
+			conn_drop(req);
+			err(-ETIMEOUT, "Query timed out", query);
+			return -1;
+		}
+
+		conn_drop(req);
+		query_deadline(req, q, dl);
+		rc = execute_once(req, query, q, data, reply, r, stream, mm, ns, false);
+	}
+
+	return rc;
+}
+
+/** Get statistics entry of query */
+static struct stats *query_stats(struct req *req, struct query *q, const char *query)
+{
+	struct stats *s;
+
+	if (q && (s = __atomic_load_n(&q->stats, __ATOMIC_ACQUIRE)))
+		return s;
+
+	s = stats_get(uthp_char(req->prv, "sqler", "role"), query);
+	if (q)
+		__atomic_store_n(&q->stats, s, __ATOMIC_RELEASE);
+
+	return s;
+}
+
+/** Record statistics of executed query */
+static void query_done(struct stats *s, uint64_t *ns, struct result *r, bool ok)
+{
+	int i;
+
+	stats_add(s, calls, 1);
+	if (!ok)
+		stats_add(s, errors, 1);
+
+	stats_add(s, rows, r->count);
+	stats_add(s, bytes, r->bytes);
+
+	for (i = 0; i < ST_MAX; i++) {
+		if (ns[i])
+			stats_time(s, i, ns[i]);
+	}
+}
+
+/** Max. time to wait for identical query being executed [ms] */
+static int flight_wait(struct req *req, struct query *q)
+{
+	struct dbpool *pool;
+	int ms;
+
+	pool = uthp_ptr(req->prv, "sqler", "pool");
+	ms = (q->timeout > 0) ? q->timeout : (pool ? pool->timeout : 0);
+
+	return ms > 0 ? ms : SQLER_FLIGHT_WAIT;
+}
+
+/** Put finished cache entry in reply
+ * @param how         reply flag to set */
+static bool run_cached(struct req *req, struct centry *ce, ut *reply, struct stats *st, const char *how)
+{
+	struct result r;
+	uint64_t ns[ST_MAX] = { 0 }, start;
+	bool ret;
+
+	start = stats_clock();
+	result_cached(&r, ce);
+	ret = reply_result(req, &r, reply);
+	cache_release(ce);
+
+	uth_set_bool(reply, how, true);
+
+	ns[ST_REPLY] = stats_clock() - start;
+	if (streq(how, "coalesced"))
+		stats_add(st, coalesced, 1);
+	else
+		stats_add(st, cached, 1);
+	query_done(st, ns, &r, ret);
+	return ret;
+}
+
+/** Execute checked query and put its result in reply
+ * @param query       normalized query
+ * @param q           compiled query, NULL if role has no whitelist
+ * @param usecache    result cache may be used */
+static bool run_query(struct req *req, char *query, struct query *q, tlist *data, ut *reply, bool usecache)
+{
+	struct result r;
+	struct centry *ce = NULL;
+	struct deadline dl;
+	struct stats *st;
+	uint64_t ns[ST_MAX] = { 0 }, start;
+	char *key;
+	bool ret, stream, coalesce, flight = false;
+	int rc;
+
+	memset(&r, 0, sizeof r);
+	st = query_stats(req, q, query);
+	stream = uth_bool(req->params, "stream");
+
+	/* transaction may see its own uncommitted writes */
+	coalesce = cache.coalesce && !uth_bool(uth_path_create(req->prv, "sqler"), "trx");
+
+	/******* try the cache *******/
+	if (usecache && q && q->readonly && !stream && (q->ttl > 0 || coalesce)) {
+		key = cache_key(req, q, query, data);
+
+		if (q->ttl > 0 && (ce = cache_get(key))) {
+			dbg(8, "cache hit: %s\n", query);
+			return run_cached(req, ce, reply, st, "cached");
+		}
+
+		if (!coalesce) {
+			ce = cache_start(q, key);
+		} else if ((flight = flight_start(q, key, flight_wait(req, q), &ce))) {
+			/* we execute it, others may wait for us */
+		} else if (ce && ce->ok) {
+			dbg(8, "coalesced: %s\n", query);
+			return run_cached(req, ce, reply, st, "coalesced");
+		} else {
+			/* the other one failed or takes too long, try on our own */
+			if (ce)
+				cache_release(ce);
+			ce = q->ttl > 0 ? cache_start(q, key) : NULL;
+		}
+	}
+
+	/******* make the query ********/
+	query_deadline(req, q, &dl);
+	rc = execute(req, query, q, data, reply, &r, stream, req, ns, &dl);
+	if (rc <= 0) {
+		ret = (rc == 0);
+		goto end;
+	}
+
+	/******* fetch the results ********/
+	if (ce)
+		result_record(&r, ce);
+
+	start = stats_clock();
+	ret = reply_result(req, &r, reply);
+	result_free(&r);
+
+	/* fetching is interleaved with building reply */
+	ns[ST_FETCH] = r.fetch_ns;
+	ns[ST_REPLY] = stats_clock() - start - r.fetch_ns;
+
+end:
+	if (deadline_stop(&dl)) {
+		conn_drop(req);
+		ret = err(-ETIMEOUT, "Query timed out", query);
+	}
+
+	if (ce && flight)
+		flight_end(ce, ret, q->ttl > 0);
+	else if (ce)
+		cache_put(ce, ret);
+
+	query_done(st, ns, &r, ret);
+	return ret;
+}
+
+/****************** Cursors ******************/
+
+/** Result set read page by page in subsequent requests */
+struct cursor {
+	mmatic *mm;                  /** memory of this cursor */
+	const char *id;              /** cursor ID */
+	const char *session;         /** session that owns the cursor */
+	struct dbconn *conn;         /** connection pinned by the cursor */
+	struct dbpool *pool;         /** pool the cursor counts against */
+	struct result r;             /** open result stream */
+	time_t used;                 /** time of last use */
+	bool busy;                   /** being read by a request */
+	int timeout;                 /** timeout of reading a page [ms] */
+	bool killed;                 /** query was killed, connection is unusable */
+};
+
+/** Open cursors */
+static struct {
+	pthread_mutex_t lock;        /** protects everything below and cursor busy flags */
+	mmatic *mm;                  /** memory for cursor structures */
+	thash *open;                 /** cursor ID -> struct cursor */
+	int num;                     /** number of cursors, including ones being opened */
+	int max;                     /** max. number of open cursors */
+	int timeout;                 /** idle cursor timeout [s] */
+} cursors = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/** Make random cursor ID */
+static char *cursor_id(void *mm)
+{
+	char *id;
+
+	id = random_hex(16, mm);
+	if (!id)
+		die("could not generate cursor ID");
+
+	return id;
+}
+
+/** Reserve place for new cursor of role pool
+ * Cursors may take at most half of connections of a pool, as they keep them
+ * while idle.
+ * @retval false      too many cursors */
+static bool cursor_reserve(struct dbpool *pool)
+{
+	bool ret = false;
+
+	pthread_mutex_lock(&cursors.lock);
+	if (cursors.num < cursors.max && pool->cursors < pool->max / 2) {
+		cursors.num++;
+		pool->cursors++;
+		ret = true;
+	}
+	pthread_mutex_unlock(&cursors.lock);
+
+	return ret;
+}
+
+/** Give back place reserved by cursor_reserve() */
+static void cursor_unreserve(struct dbpool *pool)
+{
+	pthread_mutex_lock(&cursors.lock);
+	cursors.num--;
+	pool->cursors--;
+	pthread_mutex_unlock(&cursors.lock);
+}
+
+/** Free cursor and return its connection to the pool
+ * If not all rows were read, the connection is closed instead, as the client
+ * library would read and discard all remaining rows.
+ * @note cursor must be already removed from cursors.open */
+static void cursor_close(struct cursor *c)
+{
+	dbg(8, "closing cursor %s\n", c->id);
+
+	/* make discarding fail at once */
+	if (!c->r.eof) {
+		shutdown(mysql_get_socket(c->conn->mysql), SHUT_RDWR);
+		c->killed = true;
+	}
+
+	result_free(&c->r);
+	if (c->killed)
+		pool_drop(c->conn);
+	else
+		pool_put(c->conn);
+
+	cursor_unreserve(c->pool);
+	mmatic_free(c->mm);
+}
+
+/** Close cursors idle for longer than cursors.timeout */
+static void cursor_sweep(void)
+{
+	struct cursor *c;
+	const char *id;
+	tlist *old;
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&cursors.lock);
+
+	if (thash_count(cursors.open) == 0) {
+		pthread_mutex_unlock(&cursors.lock);
+		return;
+	}
+
+	old = tlist_create(NULL, cursors.mm);
+	THASH_ITER_LOOP(cursors.open, id, c) {
+		if (!c->busy && now - c->used > cursors.timeout)
+			tlist_push(old, c);
+	}
+
+	TLIST_ITER_LOOP(old, c)
+		thash_set(cursors.open, c->id, NULL);
+
+	pthread_mutex_unlock(&cursors.lock);
+
+	TLIST_ITER_LOOP(old, c) {
+		dbg(3, "cursor %s timed out\n", c->id);
+		cursor_close(c);
+	}
+
+	tlist_free(old);
+}
+
+/** Close idle cursors, also when no queries come */
+static void *cursor_thread(void *arg)
+{
+	while (true) {
+		sleep(cursors.timeout > 2 ? cursors.timeout / 2 : 1);
+		cursor_sweep();
+	}
+
+	return NULL;
+}
+
+/** Put next page of cursor in reply, close the cursor if all rows were read */
+static bool cursor_page(struct req *req, struct cursor *c)
+{
+	struct deadline dl;
+	bool ret;
+
+	c->r.count = 0;
+	if (uth_int(req->params, "pagesize") > 0)
+		c->r.limit = uth_int(req->params, "pagesize");
+
+	deadline_start(&dl, c->conn, c->timeout);
+	ret = reply_result(req, &c->r, req->reply);
+	if (deadline_stop(&dl)) {
+		c->killed = true;
+		ret = err(-ETIMEOUT, "Query timed out", c->id);
+	}
+
+	pthread_mutex_lock(&cursors.lock);
+	if (ret && !c->r.eof) {
+		c->busy = false;
+		c->used = time(NULL);
+		uth_set_char(req->reply, "cursor", c->id);
+		pthread_mutex_unlock(&cursors.lock);
+	} else {
+		thash_set(cursors.open, c->id, NULL);
+		pthread_mutex_unlock(&cursors.lock);
+		cursor_close(c);
+	}
+
+	return ret;
+}
+
+/** Execute query and return its first page through a new cursor */
+static bool cursor_open(struct req *req, char *query, struct query *q, tlist *data, int pagesize)
+{
+	struct cursor *c;
+	struct deadline dl;
+	struct dbpool *pool;
+	mmatic *mm;
+	int rc;
+
+	pool = uthp_ptr(req->prv, "sqler", "pool");
+	if (!cursor_reserve(pool))
+		return err(-ECURSOR, "Too many open cursors", NULL);
+
+	mm = mmatic_create();
+	c = mmatic_zalloc(sizeof *c, mm);
+	c->mm = mm;
+	c->pool = pool;
+	c->id = cursor_id(mm);
+	c->session = mmatic_strdup(uth_char(req->params, "session"), mm);
+
+	query_deadline(req, q, &dl);
+	rc = execute(req, query, q, data, req->reply, &c->r, true, mm, NULL, &dl);
+	if (deadline_stop(&dl)) {
+		if (rc > 0)
+			result_free(&c->r);
+
+		conn_drop(req);
+		cursor_unreserve(pool);
+		mmatic_free(mm);
+		return err(-ETIMEOUT, "Query timed out", query);
+	}
+
+	if (rc <= 0) {
+		cursor_unreserve(pool);
+		mmatic_free(mm);
+		return (rc == 0);
+	}
+
+	/* the connection stays with the cursor until it is closed */
+	c->conn = conn_detach(req);
+	c->timeout = query_timeout(c->conn, q);
+	c->r.limit = pagesize;
+	c->busy = true;
+
+	pthread_mutex_lock(&cursors.lock);
+	thash_set(cursors.open, c->id, c);
+	pthread_mutex_unlock(&cursors.lock);
+
+	return cursor_page(req, c);
+}
+
+/** Continue reading from cursor */
+static bool cursor_next(struct req *req, const char *id)
+{
+	struct cursor *c;
+
+	pthread_mutex_lock(&cursors.lock);
+
+	c = thash_get(cursors.open, id);
+	if (!c || !streq(c->session, uth_char(req->params, "session"))) {
+		pthread_mutex_unlock(&cursors.lock);
+		return err(-ECURSOR, "Cursor not found", id);
+	}
+
+	if (c->busy) {
+		pthread_mutex_unlock(&cursors.lock);
+		return err(-ECURSOR, "Cursor busy", id);
+	}
+
+	c->busy = true;
+
+	/* close on client request */
+	if (uth_bool(req->params, "close")) {
+		thash_set(cursors.open, id, NULL);
+		pthread_mutex_unlock(&cursors.lock);
+
+		cursor_close(c);
+		uth_set_bool(req->reply, "closed", true);
+		return true;
+	}
+
+	pthread_mutex_unlock(&cursors.lock);
+	return cursor_page(req, c);
+}
+
+/** Execute read-only batch items concurrently, on up to SQLER_ASYNC_CONNS connections
+ * @retval false      an item failed, error set in reply */
+static bool run_concurrent(struct req *req, char **queries, struct query **qs, tlist *batch, ut *results)
+{
+	struct dbpool *pool;
+	struct dbconn *conns[SQLER_ASYNC_CONNS];
+	struct deadline dls[SQLER_ASYNC_CONNS];
+	bool killed[SQLER_ASYNC_CONNS] = { false };
+	struct aquery **aqs, **queue;
+	struct centry **ces, *ce;
+	struct result r;
+	ut *item, **replies;
+	tlist *data;
+	char *key;
+	struct stats *st;
+	uint64_t ns[ST_MAX] = { 0 };
+	int i, j, n, nconn, num, timeout = 0;
+	bool ret = true;
+
+	if (!conn_route(req, true))
+		return err(-ECONN, "DB connection not available", uthp_char(req->prv, "sqler", "role"));
+
+	num = tlist_count(batch);
+	aqs = mmatic_zalloc(sizeof(struct aquery *) * num, req);
+	queue = mmatic_zalloc(sizeof(struct aquery *) * num, req);
+	ces = mmatic_zalloc(sizeof(struct centry *) * num, req);
+	replies = mmatic_zalloc(sizeof(ut *) * num, req);
+
+	/* answer from the cache what we can, queue the rest */
+	n = i = 0;
+	TLIST_ITER_LOOP(batch, item) {
+		data = uth_tlist(item, "data");
+		replies[i] = utl_add_thash(results, NULL);
+
+		if (qs[i]->ttl > 0) {
+			key = cache_key(req, qs[i], queries[i], data);
+
+			ce = cache_get(key);
+			if (ce) {
+				dbg(8, "cache hit: %s\n", queries[i]);
+				result_cached(&r, ce);
+				if (!reply_result(req, &r, replies[i]))
+					ret = false;
+				cache_release(ce);
+
+				uth_set_bool(replies[i], "cached", true);
+				st = query_stats(req, qs[i], queries[i]);
+				stats_add(st, cached, 1);
+				query_done(st, ns, &r, ret);
+				i++;
+				continue;
+			}
+
+			ces[i] = cache_start(qs[i], key);
+		}
+
+		aqs[i] = mmatic_zalloc(sizeof(struct aquery), req);
+		aqs[i]->sql = fill_query(req, qs[i], data);
+		queue[n++] = aqs[i];
+
+		if (qs[i]->timeout > timeout)
+			timeout = qs[i]->timeout;
+		i++;
+	}
+
+	/* borrow more connections from the same server, but only those available right now */
+	conns[0] = uthp_ptr(req->prv, "sqler", "dbconn");
+	pool = conns[0]->pool;
+	for (nconn = 1; ret && nconn < n && nconn < SQLER_ASYNC_CONNS; nconn++) {
+		conns[nconn] = pool_tryget(pool);
+		if (!conns[nconn])
+			break;
+	}
+
+	if (ret && n > 0) {
+		for (i = 0; i < n; i++)
+			queue[i]->conn = conns[i % nconn];
+
+		/* one deadline per connection, by the longest item timeout */
+		for (i = 0; i < nconn; i++)
+			deadline_start(&dls[i], conns[i], timeout > 0 ? timeout : pool->timeout);
+
+		dbg(5, "executing %d batch items on %d connections\n", n, nconn);
+		async_run(queue, n, req);
+
+		for (i = 0; i < nconn; i++)
+			killed[i] = deadline_stop(&dls[i]);
+	}
+
+	/* reply in batch order */
+	for (i = 0; i < num; i++) {
+		if (!aqs[i])
+			continue;
+
+		for (j = 0; j < nconn && conns[j] != aqs[i]->conn; j++);
+
+		memset(&r, 0, sizeof r);
+		if (ret && aqs[i]->errcode && j < nconn && killed[j]) {
+			dbg(3, "batch item %d timed out\n", i);
+			ret = err(-ETIMEOUT, "Query timed out", queries[i]);
+		} else if (ret && aqs[i]->errcode) {
+			dbg(3, "batch item %d failed\n", i);
+			ret = err(-EQUERY, "SQL query failed",
+				pb("MySQL errno %u: %s", aqs[i]->errcode, aqs[i]->error));
+		} else if (ret && result_async(req, &r, aqs[i])) {
+			if (ces[i])
+				result_record(&r, ces[i]);
+
+			ret = reply_result(req, &r, replies[i]);
+			aqs[i]->res = NULL;
+			result_free(&r);
+		} else if (ret) {
+			uth_set_int(replies[i], "insert_id", aqs[i]->insert_id);
+			uth_set_int(replies[i], "affected", aqs[i]->affected);
+		}
+
+		if (aqs[i]->res)
+			mysql_free_result(aqs[i]->res);
+		if (ces[i])
+			cache_put(ces[i], ret);
+
+		query_done(query_stats(req, qs[i], queries[i]), ns, &r, ret && !aqs[i]->errcode);
+	}
+
+	for (i = 1; i < nconn; i++) {
+		if (killed[i])
+			pool_drop(conns[i]);
+		else
+			pool_put(conns[i]);
+	}
+
+	if (killed[0])
+		conn_drop(req);
+
+	return ret;
+}
+
+/** Execute many queries in one request
+ * All queries are checked before executing any of them. Execution stops on
+ * first failure. */
+static bool run_batch(struct req *req, tlist *batch)
+{
+	MYSQL *conn = NULL;
+	ut *item, *results;
+	char **queries;
+	struct query **qs, **cqs;
+	bool trx, ret = true;
+	int i, n, num;
+
+	num = tlist_count(batch);
+	queries = mmatic_alloc(sizeof(char *) * (num + 1), req);
+	qs = mmatic_alloc(sizeof(struct query *) * (num + 1), req);
+
+	/* check everything first */
+	i = 0;
+	TLIST_ITER_LOOP(batch, item) {
+		if (ut_type(item) != T_HASH || !uth_char(item, "query"))
+			return err(-EARGS, "Invalid batch item", pb("%d", i));
+
+		if (!check_query(req, uth_char(item, "query"), &queries[i], &qs[i]))
+			return false;
+
+		i++;
+	}
+
+	trx = uth_bool(req->params, "transaction");
+
+	/* independent reads can overlap on several connections */
+	if (!trx && num > 1 && !uth_bool(req->params, "stream")) {
+		cqs = mmatic_alloc(sizeof(struct query *) * num, req);
+		for (i = 0; i < num; i++) {
+			cqs[i] = qs[i] ? qs[i] : compile_query(queries[i], NULL, req);
+			if (!cqs[i]->readonly)
+				break;
+		}
+
+		if (i == num) {
+			results = uth_set_tlist(req->reply, "results", NULL);
+			return run_concurrent(req, queries, cqs, batch, results);
+		}
+	}
+
+	if (trx) {
+		conn = conn_route(req, false);
+		if (!conn)
+			return err(-ECONN, "DB connection not available", uthp_char(req->prv, "sqler", "role"));
+
+		if (mysql_query(conn, "START TRANSACTION") != 0)
+			return sqlerr(-EQUERY, "Starting transaction failed");
+
+		/* must not continue on another connection */
+		uth_set_bool(uth_path_create(req->prv, "sqler"), "trx", true);
+	}
+
+	results = uth_set_tlist(req->reply, "results", NULL);
+
+	/* results of uncommitted transaction must not get into the cache */
+	i = 0;
+	TLIST_ITER_LOOP(batch, item) {
+		ret = run_query(req, queries[i], qs[i], uth_tlist(item, "data"),
+			utl_add_thash(results, NULL), !trx);
+		if (!ret) {
+			dbg(3, "batch item %d failed\n", i);
+			break;
+		}
+
+		i++;
+	}
+
+	if (trx) {
+		/* connection is gone if an item timed out or lost it */
+		if (!uthp_ptr(req->prv, "sqler", "dbconn") || uthp_ptr(req->prv, "sqler", "conn") != conn)
+			conn = NULL;
+
+		if (ret && conn && mysql_query(conn, "COMMIT") != 0)
+			ret = sqlerr(-EQUERY, "Committing transaction failed");
+		else if (!ret && conn)
+			mysql_query(conn, "ROLLBACK");
+
+		/* readers could have cached uncommitted state meanwhile */
+		n = ret ? num : i + 1;
+		for (i = 0; i < n; i++) {
+			if (!qs[i])
+				qs[i] = compile_query(queries[i], NULL, req);
+			if (!qs[i]->readonly)
+				cache_invalidate(qs[i]);
+		}
+	}
+
+	return ret;
+}
+
+/****************** Bulk insert ******************/
+
+/** Limits of a single INSERT in bulk mode */
+static struct {
+	int rows;                    /** max. rows */
+	int bytes;                   /** max. size of rows in SQL */
+} bulk;
+
+/** Insert rows of ?arrays? argument in chunks of bounded size
+ * Each chunk is a separate INSERT, all in a transaction if requested. The
+ * reply has totals and per-chunk progress, also when a chunk fails. */
+static bool run_bulk(struct req *req, char *query, struct query *q, tlist *data)
+{
+	static __thread struct tbuf buf;
+	struct slice sl;
+	struct deadline dl;
+	struct stats *st;
+	MYSQL *conn;
+	tlist *rows;
+	ut *arg, *arrays = NULL, *progress, *chunk;
+	my_ulonglong affected = 0, insert_id = 0;
+	uint64_t ns[ST_MAX] = { 0 };
+	struct result r;
+	size_t bytes;
+	bool trx, ret = true;
+	char *sql;
+	int i, n, rc;
+
+	if (!q)
+		q = compile_query(query, NULL, req);
+
+	if (q->readonly)
+		return err(-EARGS, "Bulk mode needs a modifying query", query);
+
+	/* find the ?arrays? argument, as fill_query() pairs them */
+	if (data) {
+		tlist_reset(data);
+		for (i = 0; i < q->nsegs; i++) {
+			if (q->segs[i].ph == PH_NONE || q->segs[i].ph == PH_LOGIN || q->segs[i].ph == PH_ROLE)
+				continue;
+
+			arg = tlist_iter(data);
+			if (!arg)
+				break;
+
+			if (q->segs[i].ph == PH_ARRAYS) {
+				arrays = arg;
+				break;
+			}
+		}
+	}
+
+	if (!arrays || ut_type(arrays) != T_LIST)
+		return err(-EARGS, "Bulk mode needs ?arrays? argument", query);
+
+	/* index rows, so chunks are cheap to cut */
+	rows = ut_tlist(arrays);
+	n = tlist_count(rows);
+	sl.rows = mmatic_alloc(sizeof(ut *) * (n + 1), req);
+	i = 0;
+	TLIST_ITER_LOOP(rows, arg) {
+		if (ut_type(arg) != T_LIST)
+			return err(-EARGS, "Invalid bulk row", pb("%d", i));
+		sl.rows[i++] = arg;
+	}
+
+	conn = conn_route(req, false);
+	if (!conn)
+		return err(-ECONN, "DB connection not available", uthp_char(req->prv, "sqler", "role"));
+
+	trx = uth_bool(req->params, "transaction");
+	if (trx && mysql_query(conn, "START TRANSACTION") != 0)
+		return sqlerr(-EQUERY, "Starting transaction failed");
+	if (trx)
+		uth_set_bool(uth_path_create(req->prv, "sqler"), "trx", true);
+
+	st = query_stats(req, q, query);
+	progress = uth_set_tlist(req->reply, "progress", NULL);
+
+	for (sl.first = 0; sl.first < n; sl.first += sl.num) {
+		for (sl.num = 0, bytes = 0; sl.first + sl.num < n && sl.num < bulk.rows; sl.num++) {
+			bytes += list_size(sl.rows[sl.first + sl.num]) + 1;
+			if (sl.num > 0 && bytes > bulk.bytes)
+				break;
+		}
+
+		query_deadline(req, q, &dl);
+		sql = fill_slice(req, q, data, &sl, &buf);
+		rc = mysql_query(conn, sql);
+
+		memset(&r, 0, sizeof r);
+		if (deadline_stop(&dl)) {
+			conn_drop(req);
+			conn = NULL;
+			ret = err(-ETIMEOUT, "Query timed out", query);
+		} else if (rc != 0) {
+			ret = sqlerr(-EQUERY, "SQL query failed");
+		}
+
+		query_done(st, ns, &r, ret);
+		if (!ret) {
+			dbg(3, "bulk insert failed after %d of %d rows\n", sl.first, n);
+			break;
+		}
+
+		chunk = utl_add_thash(progress, NULL);
+		uth_set_int(chunk, "rows", sl.num);
+		uth_set_int(chunk, "affected", mysql_affected_rows(conn));
+
+		affected += mysql_affected_rows(conn);
+		if (!insert_id)
+			insert_id = mysql_insert_id(conn);
+
+		dbg(5, "bulk insert: %d of %d rows\n", sl.first + sl.num, n);
+	}
+
+	if (trx) {
+		if (ret && mysql_query(conn, "COMMIT") != 0)
+			ret = sqlerr(-EQUERY, "Committing transaction failed");
+		else if (!ret && conn)
+			mysql_query(conn, "ROLLBACK");
+	}
+
+	cache_invalidate(q);
+
+	uth_set_int(req->reply, "insert_id", insert_id);
+	uth_set_int(req->reply, "affected", affected);
+	return ret;
+}
+
+/*******************************************************/
+
+static bool init(struct mod *mod)
+{
+	thash *scan;
+	tlist *scanlist;
+	ut *v, *scandef, *ttls;
+	struct role *rl;
+	const char *rolename;
+	char *path, *ext, *ast, *dir, *slash;
+	pthread_t tid;
+	mmatic *mm;
+	int ttl, threads;
+
+	/*
+	 * result cache
+	 */
+	cache.mm = mmatic_create();
+	cache.entries = thash_create_strkey(NULL, cache.mm);
+	cache.fifo = tlist_create(NULL, cache.mm);
+	cache.tables = thash_create_strkey(NULL, cache.mm);
+	cache.max = uth_get(mod->cfg, "cache-size") ? uth_int(mod->cfg, "cache-size") : SQLER_CACHE_SIZE;
+	cache.coalesce = uth_bool(mod->cfg, "coalesce");
+	cache.flights = thash_create_strkey(NULL, cache.mm);
+
+	ttl = uth_int(mod->cfg, "cache-ttl");
+
+	/*
+	 * cursors
+	 */
+	cursors.mm = mmatic_create();
+	cursors.open = thash_create_strkey(NULL, cursors.mm);
+	cursors.max = uth_get(mod->cfg, "cursor-max") ? uth_int(mod->cfg, "cursor-max") : SQLER_CURSOR_MAX;
+	cursors.timeout = uth_get(mod->cfg, "cursor-timeout") ?
+		uth_int(mod->cfg, "cursor-timeout") : SQLER_CURSOR_TIMEOUT;
+
+	if (pthread_create(&tid, NULL, cursor_thread, NULL) != 0) {
+		dbg(0, "could not start cursor thread\n");
+		return false;
+	}
+	pthread_detach(tid);
+
+	ttls = uth_get(mod->cfg, "cache");
+
+	/*
+	 * scan source code for sql queries
+	 */
+	reload.mm = mmatic_create();
+	reload.roles = tlist_create(NULL, reload.mm);
+	reload.watches = thash_create_strkey(NULL, reload.mm);
+	reload.ttls = ttls;
+	reload.ttl = ttl;
+	reload.timeouts = uth_get(mod->cfg, "timeouts");
+
+	/*
+	 * bulk insert
+	 */
+	bulk.rows = uth_get(mod->cfg, "bulk-rows") ? uth_int(mod->cfg, "bulk-rows") : SQLER_BULK_ROWS;
+	bulk.bytes = uth_get(mod->cfg, "bulk-bytes") ? uth_int(mod->cfg, "bulk-bytes") : SQLER_BULK_BYTES;
+	if (bulk.rows < 1)
+		bulk.rows = 1;
+
+	/* scan files in parallel, skip those unchanged since last run */
+	reload.jobs = tlist_create(NULL, reload.mm);
+	reload.manifest = uth_char(mod->cfg, "manifest");
+	mm = mmatic_create();
+	if (reload.manifest)
+		manifest_read(mm);
+
+	threads = uth_get(mod->cfg, "scan-threads") ?
+		uth_int(mod->cfg, "scan-threads") : sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1)
+		threads = 1;
+	if (threads > SQLER_SCAN_THREADS)
+		threads = SQLER_SCAN_THREADS;
+
+	/* watch sources for changes, unless disabled */
+	if (!uth_get(mod->cfg, "reload") || uth_bool(mod->cfg, "reload")) {
+		reload.fd = inotify_init1(IN_CLOEXEC);
+		if (reload.fd < 0)
+			dbg(1, "inotify failed, queries will not be reloaded: %s\n", strerror(errno));
+	}
+
+	scan = uth_thash(mod->cfg, "scan");
+	THASH_ITER_LOOP(scan, rolename, v) {
+		rl = mmatic_zalloc(sizeof *rl, reload.mm);
+		rl->name = rolename;
+		rl->files = thash_create_strkey(NULL, reload.mm);
+		tlist_push(reload.roles, rl);
+
+		/* create storage point */
+		rl->slot = mmatic_zalloc(sizeof(struct qslot), reload.mm);
+		uth_set_ptr(uth_path_create(mod->dir->prv, "sqler", "roles", rolename), "queries", rl->slot);
+
+		scanlist = ut_tlist(v);
+		TLIST_ITER_LOOP(scanlist, scandef) {
+			/* unconst */
+			path = mmatic_strdup(ut_char(scandef), mod);
+
+			/* get dir path and file extension */
+			ext = NULL;
+			ast = strchr(path, '*');
+			if (ast) {
+				*ast = '\0';
+				if (ast[1] == '.')
+					ext = ast + 2;
+				else
+					ext = ast + 1;
+
+				if (!ext[0])
+					ext = SQLER_DEFAULT_EXT;
+
+				scan_dir(rl, path, ext);
+			} else {
+				load_file(rl, path);
+
+				/* watch its directory */
+				dir = mmatic_strdup(path, mod);
+				slash = strrchr(dir, '/');
+				if (slash)
+					*slash = '\0';
+				watch_add(rl, slash ? dir : ".", NULL, path);
+			}
+		}
+	}
+
+	scan_jobs(threads);
+	reload.jobs = NULL;
+	reload.mentries = NULL;
+	mmatic_free(mm);
+
+	TLIST_ITER_LOOP(reload.roles, rl)
+		publish(rl);
+
+	manifest_write();
+
+	if (reload.fd >= 0) {
+		if (pthread_create(&tid, NULL, reload_thread, NULL) != 0) {
+			dbg(0, "could not start query reload thread\n");
+			return false;
+		}
+
+		pthread_detach(tid);
+	}
+
+	return true;
+}
+
+static bool _handle(struct req *req)
+{
+	const char *orig_query, *cursor;
+	struct query *q;
+	tlist *batch;
+	char *query;
+	int pagesize;
+
+	cursor = uth_char(req->params, "cursor");
+	if (cursor)
+		return cursor_next(req, cursor);
+
+	batch = uth_tlist(req->params, "batch");
+	if (batch)
+		return run_batch(req, batch);
+
+	orig_query = uth_char(req->params, "query");
+	if (!orig_query)
+		return err(-EARGS, "Query or batch required", NULL);
+
+	if (!check_query(req, orig_query, &query, &q))
+		return false;
+
+	if (uth_bool(req->params, "bulk"))
+		return run_bulk(req, query, q, uth_tlist(req->params, "data"));
+
+	pagesize = uth_int(req->params, "pagesize");
+	if (pagesize > 0)
+		return cursor_open(req, query, q, uth_tlist(req->params, "data"), pagesize);
+
+	return run_query(req, query, q, uth_tlist(req->params, "data"), req->reply, true);
+}
+
+static bool handle(struct req *req)
+{
+	bool ret;
+
+	qtable_pin(req);
+	ret = _handle(req);
+	conn_put(req);
+	qtable_put(req);
+
+	return ret;
 }
 
 struct api query_api = {
@@ -362,8 +3214,17 @@ struct api query_api = {
 };
 
 struct fw query_fw[] = {
-	{ "query", true, T_STRING, NULL },
+	{ "query", false, T_STRING, NULL },                  /* required unless batch given */
 	{ "verbose", false, T_BOOL, NULL },
 	{ "data", false, T_LIST, NULL },
+	{ "stream", false, T_BOOL, NULL },                   /* do not buffer result set in MySQL client */
+	{ "format", false, T_STRING, "/^(rows|columns|json)$/" }, /* result layout */
+	{ "dict", false, T_BOOL, NULL },                     /* "columns": dictionary-encode strings */
+	{ "batch", false, T_LIST, NULL },                    /* list of { query, data } to execute */
+	{ "transaction", false, T_BOOL, NULL },              /* batch, bulk: execute in a transaction */
+	{ "pagesize", false, T_INT, NULL },                  /* return rows in pages, through a cursor */
+	{ "cursor", false, T_STRING, "/^[a-f0-9]+$/" },      /* continue reading from cursor */
+	{ "close", false, T_BOOL, NULL },                    /* cursor: close it */
+	{ "bulk", false, T_BOOL, NULL },                     /* insert ?arrays? rows in chunks */
 	NULL,
 };
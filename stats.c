@@ -0,0 +1,35 @@
+/*
+ * sqler - a JavaScript-MySQL bridge in C
+ *
+ * Copyright (C) 2010 Pawel Foremski <pawel@foremski.pl>
+ * Licensed under GPLv3
+ */
+
+#include <rpcd/rpcd_module.h>
+#include "common.h"
+
+static bool handle(struct req *req)
+{
+	const char *role;
+
+	role = uthp_char(req->prv, "sqler", "role");
+	if (!role || !streq(role, "admin")) {
+		conn_put(req);
+		return err(-EDENY, "Access denied", role);
+	}
+
+	stats_reply(req->reply, uth_bool(req->params, "reset"));
+	conn_put(req);
+
+	return true;
+}
+
+struct api stats_api = {
+	.tag = RPCD_TAG,
+	.handle = handle
+};
+
+struct fw stats_fw[] = {
+	{ "reset", false, T_BOOL, NULL },
+	NULL,
+};